@@ -0,0 +1,684 @@
+/* luz-bench - timings of luz, without GEGL
+ *
+ * luz is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * luz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with luz; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * usage: luz-bench [--coats 3,4] [--threads 1,2,4] [--iterations n]
+ *                  [--config file] [--json out.json]
+ *
+ *        luz-bench --colorchecker [--config file] [--json out.json]
+ *                  [--baseline old.json] [--de-tolerance 0.25]
+ *                  [--time-tolerance 0.5] [--max-de n]
+ *
+ * the second form separates and proofs the builtin colorchecker and ceramic
+ * tile spectra for a set of solver settings, recording round-trip CIEDE2000
+ * and wall time; it exits with a non-zero status when accuracy or speed
+ * regressed beyond the tolerances compared to a baseline from an earlier
+ * run, or when the mean error exceeds --max-de. Speed is compared as time
+ * relative to the first setting, so baselines carry across machines, and
+ * only for settings taking at least CHECK_TIME_FLOOR. Results are written to
+ * luz-bench.json, or luz-colorchecker.json for the second form, unless
+ * --json names another file; make check compares against the reference
+ * in luz-colorchecker-baseline.json.
+ */
+
+/* the kernels benchmarked are static inline, so the library is compiled
+ * into this translation unit rather than linked */
+#include "luz.c"
+
+#include <time.h>
+
+#define MAX_RUNS     64
+#define PIXELS       (1024 * 256)
+
+typedef struct _BenchConfig BenchConfig;
+
+struct _BenchConfig
+{
+  const char *name;
+  int         coats;
+  const char *config;
+};
+
+static BenchConfig builtin_configs[] = {
+  {"cmy", 3,
+   "coat1=rgb 0 1 1\n"
+   "coat2=rgb 1 0 1\n"
+   "coat3=rgb 1 1 0\n"},
+  {"cmyk", 4,
+   "coat1=rgb 0 1 1\n"
+   "coat2=rgb 1 0 1\n"
+   "coat3=rgb 1 1 0\n"
+   "coat4=rgb 0 0 0\n"
+   "coatlimit=3.0\n"},
+  {"hexachrome", 6,
+   "coat1=rgb 0 1 1\n"
+   "coat2=rgb 1 0 1\n"
+   "coat3=rgb 1 1 0\n"
+   "coat4=rgb 0 0 0\n"
+   "coat5=rgb 1 0.5 0\n"
+   "coat6=rgb 0 0.7 0.2\n"
+   "coatlimit=3.0\n"},
+};
+
+typedef struct _BenchRun BenchRun;
+
+struct _BenchRun
+{
+  const char *name;
+  int         coats;
+  int         threads;
+  double      new_ms;
+  double      cell_solve_ms;
+  double      lut_fill_s;
+  double      rgb_to_coats_mpix_s;
+  double      coats_to_rgb_mpix_s;
+  LuzStats    stats;
+};
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static int
+parse_list (const char *str, int *list, int max)
+{
+  int count = 0;
+  char *p = (char*)str;
+  while (*p && count < max)
+  {
+    list[count++] = strtol (p, &p, 10);
+    while (*p == ',' || *p == ' ')
+      p++;
+  }
+  return count;
+}
+
+static char *
+read_file (const char *path)
+{
+  FILE *file = fopen (path, "rb");
+  char *data;
+  long  length;
+  if (!file)
+    return NULL;
+  fseek (file, 0, SEEK_END);
+  length = ftell (file);
+  fseek (file, 0, SEEK_SET);
+  data = calloc (length + 1, 1);
+  if (fread (data, 1, length, file) != (size_t)length)
+    length = 0;
+  data[length] = 0;
+  fclose (file);
+  return data;
+}
+
+/* deterministic pseudo random test inputs */
+static float *
+make_pixels (int count, int components)
+{
+  float *pixels = malloc (sizeof (float) * count * components);
+  uint32_t rng = luz_random_seed (0);
+  int i;
+  for (i = 0; i < count * components; i++)
+    pixels[i] = (luz_random (&rng) % 10000) / 9999.0f;
+  return pixels;
+}
+
+typedef struct _Worker Worker;
+
+struct _Worker
+{
+  Luz   *luz;
+  int    no;
+  int    count;
+  float *in;
+  float *out;
+};
+
+static void *
+fill_worker (void *data)
+{
+  Worker *w = data;
+  int dim = w->luz->lut_dim;
+  int i;
+  /* each thread starts at a different offset, so they contend like GEGL
+   * tiles would rather than waiting on the same cells */
+  for (i = 0; i < dim * dim * dim; i++)
+  {
+    int cell = (i + w->no * dim * dim * dim / w->count) % (dim * dim * dim);
+    ensure_lut (w->luz, LUZ_SPACE_RGB, cell / (dim * dim), (cell / dim) % dim, cell % dim);
+  }
+  return NULL;
+}
+
+static void *
+separate_worker (void *data)
+{
+  Worker *w = data;
+  int i;
+  for (i = 0; i < w->count; i++)
+    luz_rgb_to_coats (w->luz, w->in + i * 3, w->out + i * LUZ_MAX_COATS);
+  return NULL;
+}
+
+static void *
+proof_worker (void *data)
+{
+  Worker *w = data;
+  int i;
+  for (i = 0; i < w->count; i++)
+    luz_coats_to_rgb (w->luz, w->in + i * LUZ_MAX_COATS, w->out + i * 3);
+  return NULL;
+}
+
+static double
+run_threads (int threads, void *(*func)(void *), Luz *luz,
+             float *in, int in_stride, float *out, int out_stride, int count)
+{
+  pthread_t thread[64];
+  Worker    worker[64];
+  double    start = now ();
+  int i;
+  for (i = 0; i < threads; i++)
+  {
+    int first = count * i / threads;
+    worker[i].luz = luz;
+    worker[i].no = i;
+    worker[i].count = func == fill_worker ? threads :
+                                            count * (i + 1) / threads - first;
+    worker[i].in = in ? in + first * in_stride : NULL;
+    worker[i].out = out ? out + first * out_stride : NULL;
+    pthread_create (&thread[i], NULL, func, &worker[i]);
+  }
+  for (i = 0; i < threads; i++)
+    pthread_join (thread[i], NULL);
+  return now () - start;
+}
+
+static void
+bench_kernels (double *add_coat_ns,
+               double *integrate_ns,
+               double *upsample_ns)
+{
+  Luz *luz = luz_new ("coat1=rgb 0 1 1\n");
+  Coat *coat = &luz->coat_def[0];
+  Spectrum spec = luz->substrate;
+  volatile float sink = 0.0;
+  int    reps = 4000000;
+  double start;
+  int i;
+
+  start = now ();
+  for (i = 0; i < reps; i++)
+  {
+    add_coat (&spec, &coat->on_white, &coat->on_black, &coat->opaqueness,
+              (i & 255) / 255.0f, 1.0f, 1);
+    if ((i & 7) == 7)
+    {
+      sink += spec.bands[0];
+      spec = luz->substrate;
+    }
+  }
+  *add_coat_ns = (now () - start) * 1000000000.0 / reps;
+
+  start = now ();
+  for (i = 0; i < reps; i++)
+  {
+    spec.bands[i % LUZ_SPECTRUM_BANDS] += 0.001f;
+    sink += spectrum_integrate (&spec, &luz->STANDARD_OBSERVER_Y);
+  }
+  *integrate_ns = (now () - start) * 1000000000.0 / reps;
+
+  {
+    float *rgb = make_pixels (PIXELS, 3);
+    float *reflectance = malloc (sizeof (float) * LUZ_SPECTRUM_BANDS * PIXELS);
+    luz_rgb_to_reflectance (luz, rgb, reflectance, 1); /* fits the table */
+    start = now ();
+    luz_rgb_to_reflectance (luz, rgb, reflectance, PIXELS);
+    *upsample_ns = (now () - start) * 1000000000.0 / PIXELS;
+    sink += reflectance[0];
+    free (reflectance);
+    free (rgb);
+  }
+
+  luz_destroy (luz);
+}
+
+static void
+bench_config (BenchRun    *run,
+              const char  *config,
+              int          threads)
+{
+  float *rgb    = make_pixels (PIXELS, 3);
+  float *coats  = make_pixels (PIXELS, LUZ_MAX_COATS);
+  float *out    = malloc (sizeof (float) * PIXELS * LUZ_MAX_COATS);
+  int    cells  = 32;
+  double start;
+  Luz   *luz;
+  int i;
+
+  start = now ();
+  for (i = 0; i < 16; i++)
+    luz_destroy (luz_new (config));
+  run->new_ms = (now () - start) * 1000.0 / 16;
+
+  luz = luz_new (config);
+  run->coats = luz_get_coat_count (luz);
+
+  start = now ();
+  for (i = 0; i < cells; i++)
+  {
+    float    levels[LUZ_MAX_COATS] = {0,};
+    uint32_t rng = luz_random_seed (i);
+    _rgb_to_coats (luz, rgb + i * 3, NULL, levels, &rng);
+  }
+  run->cell_solve_ms = (now () - start) * 1000.0 / cells;
+
+  luz_reset_stats (luz);
+  run->lut_fill_s = run_threads (threads, fill_worker, luz,
+                                 NULL, 0, NULL, 0, 0);
+  luz_get_stats (luz, &run->stats);
+
+  run->rgb_to_coats_mpix_s = PIXELS / 1000000.0 /
+    run_threads (threads, separate_worker, luz,
+                 rgb, 3, out, LUZ_MAX_COATS, PIXELS);
+  run->coats_to_rgb_mpix_s = PIXELS / 1000000.0 /
+    run_threads (threads, proof_worker, luz,
+                 coats, LUZ_MAX_COATS, out, 3, PIXELS);
+
+  luz_destroy (luz);
+  free (rgb);
+  free (coats);
+  free (out);
+}
+
+static void
+write_json (const char *path,
+            double      add_coat_ns,
+            double      integrate_ns,
+            double      upsample_ns,
+            BenchRun   *runs,
+            int         run_count)
+{
+  FILE *file = fopen (path, "w");
+  int i;
+  if (!file)
+  {
+    fprintf (stderr, "luz-bench: failed to open %s\n", path);
+    return;
+  }
+  fprintf (file, "{\n");
+  fprintf (file, "  \"kernels\": {\"add_coat_ns\": %.3f, \"spectrum_integrate_ns\": %.3f, "
+                 "\"rgb_to_reflectance_ns\": %.3f},\n",
+           add_coat_ns, integrate_ns, upsample_ns);
+  fprintf (file, "  \"runs\": [\n");
+  for (i = 0; i < run_count; i++)
+  {
+    int j;
+    fprintf (file, "    {\"config\": \"%s\", \"coats\": %i, \"threads\": %i, "
+                   "\"new_ms\": %.3f, \"cell_solve_ms\": %.3f, "
+                   "\"lut_fill_s\": %.3f, \"rgb_to_coats_mpix_s\": %.3f, "
+                   "\"coats_to_rgb_mpix_s\": %.3f, "
+                   "\"fill_griddy_evaluations\": %llu, "
+                   "\"fill_stochastic_evaluations\": %llu, "
+                   "\"fill_wait_ms\": %.3f, \"fill_residual_cells\": [",
+             runs[i].name, runs[i].coats, runs[i].threads,
+             runs[i].new_ms, runs[i].cell_solve_ms, runs[i].lut_fill_s,
+             runs[i].rgb_to_coats_mpix_s, runs[i].coats_to_rgb_mpix_s,
+             (unsigned long long) runs[i].stats.griddy_evaluations,
+             (unsigned long long) runs[i].stats.stochastic_evaluations,
+             runs[i].stats.wait_ns / 1000000.0);
+    for (j = 0; j < LUZ_RESIDUAL_BINS; j++)
+      fprintf (file, "%s%llu", j ? ", " : "",
+               (unsigned long long) runs[i].stats.residual_cells[j]);
+    fprintf (file, "]}%s\n", i + 1 < run_count ? "," : "");
+  }
+  fprintf (file, "  ]\n}\n");
+  fclose (file);
+}
+
+/* colorchecker patches and ceramic tiles in the builtin spectrum database;
+ * the colorchecker orange, blue, green and red are shadowed by later
+ * definitions in luz-config.inc and left out */
+static const char *patches[] = {
+  "dark_skin", "light_skin", "blue_sky", "foilage", "blue_flower",
+  "bluish_green", "purplish_blue", "moderate_red", "purple", "yellow_green",
+  "orange_yellow", "yellow", "magenta", "cyan", "gray0", "gray1", "gray2",
+  "gray3", "gray4", "gray5",
+  "black", "deep_grey", "mid_grey", "light_grey", "white", "orange",
+  "ccyan", "cgreen", "deep_blue", "deep_pink", "cred",
+};
+
+static const char *solver_settings[] = {
+  "iterations=100 diffusion=0.55 lutdim=9",
+  "iterations=100 diffusion=0.55 lutdim=16",
+  "iterations=1000 diffusion=0.55 lutdim=16",
+  "iterations=1000 diffusion=2.2 lutdim=16",
+  "iterations=1000 diffusion=0.55 lutdim=33",
+  "iterations=1000 diffusion=0.55 lutdim=16 objective=de76",
+  "iterations=1000 diffusion=0.55 lutdim=16 objective=de2000",
+  "solver=de lutdim=16",
+  "solver=de lutdim=16 objective=de2000",
+  "solver=de lutdim=33",
+  "iterations=1000 diffusion=0.55 lutdim=16 seeds=8",
+  "solver=de table=adaptive",
+  "solver=de table=adaptive objective=de2000",
+  "solver=de direct=1",
+  "solver=de gamutmap=clip",
+  "solver=de gamutmap=compress",
+  "iterations=1000 diffusion=0.55 lutdim=16 black_coat=4",
+  "solver=de lutdim=16 black_coat=4",
+  "solver=de lutdim=16 black_coat=4 black_generation=ucr",
+  "iterations=1000 diffusion=0.55 lutdim=16 subsets=1",
+  "iterations=1000 diffusion=0.55 lutdim=16 target_de=1",
+};
+
+#define SETTINGS (int)(sizeof (solver_settings) / sizeof (solver_settings[0]))
+#define PATCHES  (int)(sizeof (patches) / sizeof (patches[0]))
+
+#define CHECK_TIMINGS    2    /* runs per setting, the fastest is kept */
+#define CHECK_TIME_FLOOR 0.25 /* seconds, shorter runs are too noisy to
+                                 compare */
+
+typedef struct _CheckRun CheckRun;
+
+struct _CheckRun
+{
+  double mean_de;
+  double max_de;
+  double seconds;
+};
+
+static void
+colorchecker_run (CheckRun   *run,
+                  const char *config,
+                  const char *setting)
+{
+  char   full[8192];
+  double start;
+  Luz   *luz;
+  int i;
+
+  snprintf (full, sizeof (full), "%s\n%s\n", config, setting);
+  for (i = strlen (config); full[i]; i++)
+    if (full[i] == ' ')
+      full[i] = '\n';
+
+  start = now ();
+  luz = luz_new (full);
+  run->mean_de = 0.0;
+  run->max_de = 0.0;
+  for (i = 0; i < PATCHES; i++)
+  {
+    const Spectrum *reflectance = luz_get_spectrum (luz, patches[i]);
+    Spectrum lit;
+    float rgb[3], xyz[3], lab[3], coats[LUZ_MAX_COATS], proof_xyz[3], proof_lab[3];
+    double de;
+
+    spectrum_scale (&lit, reflectance, &luz->illuminant);
+    spectrum_to_xyz (luz, &lit, &xyz[0], &xyz[1], &xyz[2]);
+    spectrum_to_rgb (luz, &lit, rgb);
+    xyz_to_lab (luz, xyz, lab);
+
+    luz_rgb_to_coats (luz, rgb, coats);
+    luz_coats_to_xyz (luz, coats, proof_xyz);
+    xyz_to_lab (luz, proof_xyz, proof_lab);
+
+    de = delta_e2000 (lab, proof_lab);
+    run->mean_de += de / PATCHES;
+    if (de > run->max_de)
+      run->max_de = de;
+  }
+  run->seconds = now () - start;
+  luz_destroy (luz);
+}
+
+/* finds the entry for setting in the json written by an earlier run */
+static int
+baseline_lookup (const char *json,
+                 const char *setting,
+                 CheckRun   *run)
+{
+  char key[256];
+  const char *p;
+  snprintf (key, sizeof (key), "\"setting\": \"%s\"", setting);
+  p = json ? strstr (json, key) : NULL;
+  if (!p)
+    return 0;
+  return sscanf (strstr (p, "\"mean_de\":"), "\"mean_de\": %lf, \"max_de\": %lf, \"seconds\": %lf",
+                 &run->mean_de, &run->max_de, &run->seconds) == 3;
+}
+
+static int
+colorchecker (const char *config,
+              const char *json_path,
+              const char *baseline_path,
+              double      de_tolerance,
+              double      time_tolerance,
+              double      max_de)
+{
+  char     *baseline = baseline_path ? read_file (baseline_path) : NULL;
+  CheckRun  runs[SETTINGS];
+  CheckRun  reference;
+  FILE     *file;
+  int       failed = 0;
+  int       timed;
+  int i;
+
+  if (baseline_path && !baseline)
+  {
+    fprintf (stderr, "luz-bench: failed to read %s\n", baseline_path);
+    return 1;
+  }
+
+  /* timings are compared relative to the first setting, timed alike */
+  timed = baseline_lookup (baseline, solver_settings[0], &reference) &&
+          reference.seconds > 0.0;
+
+  printf ("%-58s %8s %8s %9s\n", "setting", "mean dE", "max dE", "seconds");
+  for (i = 0; i < SETTINGS; i++)
+  {
+    CheckRun base;
+    int      t;
+    colorchecker_run (&runs[i], config, solver_settings[i]);
+    for (t = 1; t < CHECK_TIMINGS; t++)
+    {
+      CheckRun again;
+      colorchecker_run (&again, config, solver_settings[i]);
+      runs[i].seconds = MIN (runs[i].seconds, again.seconds);
+    }
+    printf ("%-58s %8.3f %8.3f %9.3f", solver_settings[i],
+            runs[i].mean_de, runs[i].max_de, runs[i].seconds);
+
+    if (max_de > 0.0 && runs[i].mean_de > max_de)
+    {
+      printf ("  FAIL mean dE above %.3f", max_de);
+      failed = 1;
+    }
+    if (baseline_lookup (baseline, solver_settings[i], &base))
+    {
+      if (runs[i].mean_de > base.mean_de + de_tolerance ||
+          runs[i].max_de > base.max_de + de_tolerance * 4)
+      {
+        printf ("  FAIL dE regressed from %.3f/%.3f", base.mean_de, base.max_de);
+        failed = 1;
+      }
+      if (timed && runs[i].seconds >= CHECK_TIME_FLOOR &&
+          runs[i].seconds / runs[0].seconds >
+          base.seconds / reference.seconds * (1.0 + time_tolerance))
+      {
+        printf ("  FAIL %.2fx the first setting, was %.2fx",
+                runs[i].seconds / runs[0].seconds,
+                base.seconds / reference.seconds);
+        failed = 1;
+      }
+    }
+    printf ("\n");
+    fflush (stdout);
+  }
+
+  file = fopen (json_path, "w");
+  if (file)
+  {
+    fprintf (file, "{\n  \"colorchecker\": [\n");
+    for (i = 0; i < SETTINGS; i++)
+      fprintf (file, "    {\"setting\": \"%s\", \"mean_de\": %.4f, "
+                     "\"max_de\": %.4f, \"seconds\": %.4f}%s\n",
+               solver_settings[i], runs[i].mean_de, runs[i].max_de,
+               runs[i].seconds, i + 1 < SETTINGS ? "," : "");
+    fprintf (file, "  ]\n}\n");
+    fclose (file);
+  }
+  else
+    fprintf (stderr, "luz-bench: failed to open %s\n", json_path);
+
+  free (baseline);
+  return failed;
+}
+
+int main (int argc, char **argv)
+{
+  int         coat_list[LUZ_MAX_COATS] = {3, 4};
+  int         coat_count = 2;
+  int         thread_list[16] = {1};
+  int         thread_count = 1;
+  int         iterations = 400;
+  const char *json_path = NULL; /* luz-bench.json, or with --colorchecker
+                                   luz-colorchecker.json */
+  char       *user_config = NULL;
+  BenchRun    runs[MAX_RUNS];
+  int         run_count = 0;
+  double      add_coat_ns, integrate_ns, upsample_ns;
+  int         check = 0;
+  const char *baseline_path = NULL;
+  double      de_tolerance = 0.25;
+  double      time_tolerance = 0.5;
+  double      max_de = 0.0;
+  int i, j, k;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp (argv[i], "--coats") && i + 1 < argc)
+      coat_count = parse_list (argv[++i], coat_list, LUZ_MAX_COATS);
+    else if (!strcmp (argv[i], "--threads") && i + 1 < argc)
+      thread_count = parse_list (argv[++i], thread_list, 16);
+    else if (!strcmp (argv[i], "--iterations") && i + 1 < argc)
+      iterations = atoi (argv[++i]);
+    else if (!strcmp (argv[i], "--json") && i + 1 < argc)
+      json_path = argv[++i];
+    else if (!strcmp (argv[i], "--colorchecker"))
+      check = 1;
+    else if (!strcmp (argv[i], "--baseline") && i + 1 < argc)
+      baseline_path = argv[++i];
+    else if (!strcmp (argv[i], "--de-tolerance") && i + 1 < argc)
+      de_tolerance = strtod (argv[++i], NULL);
+    else if (!strcmp (argv[i], "--time-tolerance") && i + 1 < argc)
+      time_tolerance = strtod (argv[++i], NULL);
+    else if (!strcmp (argv[i], "--max-de") && i + 1 < argc)
+      max_de = strtod (argv[++i], NULL);
+    else if (!strcmp (argv[i], "--config") && i + 1 < argc)
+    {
+      user_config = read_file (argv[++i]);
+      if (!user_config)
+      {
+        fprintf (stderr, "luz-bench: failed to read %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else
+    {
+      fprintf (stderr, "usage: %s [--coats 3,4] [--threads 1,2,4] "
+                       "[--iterations n] [--config file] [--json out.json]\n"
+                       "       %s --colorchecker [--config file] [--json out.json] "
+                       "[--baseline old.json] [--de-tolerance 0.25] "
+                       "[--time-tolerance 0.5] [--max-de n]\n",
+               argv[0], argv[0]);
+      return 1;
+    }
+  }
+
+  if (!json_path)
+    json_path = check ? "luz-colorchecker.json" : "luz-bench.json";
+  if (baseline_path && !strcmp (baseline_path, json_path))
+  {
+    fprintf (stderr, "luz-bench: --json would overwrite the baseline %s\n",
+             baseline_path);
+    return 1;
+  }
+
+  if (check)
+  {
+    int ret = colorchecker (user_config ? user_config : builtin_configs[1].config,
+                            json_path, baseline_path,
+                            de_tolerance, time_tolerance, max_de);
+    free (user_config);
+    return ret;
+  }
+
+  bench_kernels (&add_coat_ns, &integrate_ns, &upsample_ns);
+  printf ("add_coat            %8.2f ns\n", add_coat_ns);
+  printf ("spectrum_integrate  %8.2f ns\n", integrate_ns);
+  printf ("rgb_to_reflectance  %8.2f ns\n\n", upsample_ns);
+
+  printf ("%-12s %5s %7s %9s %10s %10s %12s %12s\n", "config", "coats",
+          "threads", "new ms", "cell ms", "lut fill s", "sep Mpix/s",
+          "proof Mpix/s");
+
+  for (i = 0; i < (int)(sizeof (builtin_configs) / sizeof (builtin_configs[0])) + 1; i++)
+  {
+    BenchConfig *bc = i < (int)(sizeof (builtin_configs) / sizeof (builtin_configs[0])) ?
+                      &builtin_configs[i] : NULL;
+    const char *name = bc ? bc->name : "user";
+    char config[8192];
+    int wanted = 0;
+
+    if (bc)
+    {
+      for (k = 0; k < coat_count; k++)
+        if (coat_list[k] == bc->coats)
+          wanted = 1;
+      if (!wanted)
+        continue;
+      snprintf (config, sizeof (config), "%siterations=%i\n",
+                bc->config, iterations);
+    }
+    else if (user_config)
+      snprintf (config, sizeof (config), "iterations=%i\n%s",
+                iterations, user_config);
+    else
+      continue;
+
+    for (j = 0; j < thread_count && run_count < MAX_RUNS; j++)
+    {
+      BenchRun *run = &runs[run_count++];
+      run->name = name;
+      run->threads = thread_list[j] < 1 ? 1 : thread_list[j] > 64 ? 64 : thread_list[j];
+      bench_config (run, config, run->threads);
+      printf ("%-12s %5i %7i %9.3f %10.3f %10.3f %12.3f %12.3f\n",
+              run->name, run->coats, run->threads, run->new_ms,
+              run->cell_solve_ms, run->lut_fill_s,
+              run->rgb_to_coats_mpix_s, run->coats_to_rgb_mpix_s);
+      fflush (stdout);
+    }
+  }
+
+  write_json (json_path, add_coat_ns, integrate_ns, upsample_ns,
+              runs, run_count);
+  free (user_config);
+  return 0;
+}
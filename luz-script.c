@@ -40,14 +40,35 @@ enum_start (coat_sim_mode)
   enum_value (GEGL_LUZ_PROOF,          "proof",          N_("Proof"))
   enum_value (GEGL_LUZ_SEPARATE,       "separate",       N_("Separate"))
   enum_value (GEGL_LUZ_SEPARATE_PROOF, "separate-proof", N_("Separate and proof"))
+  enum_value (GEGL_LUZ_PROOF_ILLUMINANTS, "proof-illuminants", N_("Proof under proof illuminants"))
+  enum_value (GEGL_LUZ_METAMERISM,     "metamerism",     N_("Metamerism map"))
+  enum_value (GEGL_LUZ_SEPARATE_SPECTRAL, "separate-spectral", N_("Separate spectral image"))
 enum_end (GeglInkSimMode)
 
 property_enum (mode, _("Mode"), GeglInkSimMode, coat_sim_mode,
                  GEGL_LUZ_SEPARATE_PROOF)
-  description (_("how the coat simulator is used"))
+  description (_("how the coat simulator is used, proof-illuminants outputs RGB for each of proof_illuminants= in the configuration, metamerism the largest CIEDE2000 change between the first and the other proof illuminants"))
+
+enum_start (luz_coat_format)
+  enum_value (GEGL_LUZ_COATS_RGBA,  "rgba",  N_("RGBA"))
+  enum_value (GEGL_LUZ_COATS_FLOAT, "float", N_("Float per coat"))
+  enum_value (GEGL_LUZ_COATS_U16,   "u16",   N_("u16 per coat"))
+enum_end (GeglLuzCoatFormat)
+
+property_enum (coat_format, _("Coat format"), GeglLuzCoatFormat, luz_coat_format,
+                 GEGL_LUZ_COATS_RGBA)
+  description (_("pixel format of separations, rgba holds up to 4 coats, the other formats have one component per coat"))
+
+property_double (spectral_start, _("Spectral start"), 400.0)
+  value_range (300.0, 800.0)
+  description (_("wavelength in nm of the first component of spectral input, for separate-spectral"))
+
+property_double (spectral_gap, _("Spectral gap"), 10.0)
+  value_range (0.1, 100.0)
+  description (_("wavelength in nm between components of spectral input"))
 
 property_int (coat_no, _("coat no"), 0)
-              value_range (0, 5)
+              value_range (0, 16)
               description (_("0 means all coat, a specific number means show output for only that color - when separating this causes a grayscale to be produced"))
 
 property_string (config, _("Ink configuration"), DEFAULT_CONFIG)
@@ -80,6 +101,9 @@ prepare (GeglOperation *operation)
   if (input_format)
     input_components = babl_format_get_n_components (input_format);
 
+  o->user_data = luz_cache_get (o->config, o->user_data);
+  luz_trace_begin (o->user_data, "prepare");
+
   switch (o->mode)
   {
     case GEGL_LUZ_PROOF:
@@ -87,10 +111,33 @@ prepare (GeglOperation *operation)
         babl_format_n (babl_type("float"), input_components));
       gegl_operation_set_format (operation, "output", babl_format ("RGBA float"));
       break;
+    case GEGL_LUZ_PROOF_ILLUMINANTS:
+      gegl_operation_set_format (operation, "input",
+        babl_format_n (babl_type("float"), input_components));
+      gegl_operation_set_format (operation, "output",
+        babl_format_n (babl_type("float"),
+                       3 * luz_get_proof_illuminant_count (o->user_data)));
+      break;
+    case GEGL_LUZ_METAMERISM:
+      gegl_operation_set_format (operation, "input",
+        babl_format_n (babl_type("float"), input_components));
+      gegl_operation_set_format (operation, "output", babl_format ("Y float"));
+      break;
+    case GEGL_LUZ_SEPARATE_SPECTRAL:
+      gegl_operation_set_format (operation, "input",
+        babl_format_n (babl_type("float"), input_components));
+      gegl_operation_set_format (operation, "output",
+        babl_format_n (babl_type("float"),
+                       MAX (1, luz_get_coat_count (o->user_data))));
+      break;
     case GEGL_LUZ_SEPARATE:
-      //gegl_operation_set_format (operation, "output",
-      //  babl_format_n (babl_type("float"), luz_get_coat_count (o->user_data)));
-      gegl_operation_set_format (operation, "output", babl_format ("RGBA float"));
+      if (o->coat_format != GEGL_LUZ_COATS_RGBA && o->coat_no == 0)
+        gegl_operation_set_format (operation, "output",
+          babl_format_n (babl_type (o->coat_format == GEGL_LUZ_COATS_U16 ?
+                                    "u16" : "float"),
+                         MAX (1, luz_get_coat_count (o->user_data))));
+      else
+        gegl_operation_set_format (operation, "output", babl_format ("RGBA float"));
 
       gegl_operation_set_format (operation, "input",
           babl_format ("RGBA float"));
@@ -102,10 +149,7 @@ prepare (GeglOperation *operation)
           babl_format ("RGBA float"));
       break;
   }
-
-  if (o->user_data)
-    luz_destroy (o->user_data);
-  o->user_data = luz_new (o->config);
+  luz_trace_end (o->user_data, "prepare");
 }
 
 static gboolean
@@ -123,43 +167,95 @@ process (GeglOperation       *op,
   int in_components =
     babl_format_get_n_components (gegl_operation_get_format (op, "input"));
 
+  luz_trace_begin (ssim, "process");
+
   switch (o->mode)
   {
     case GEGL_LUZ_PROOF:
       {
-        if (luz_get_coat_count (ssim) > 3)
-        {
-          while (samples--)
-            {
-              gfloat coats[4];
-              int i;
-              for (i = 0; i < 4; i++)
-                coats[i] = in[i];
-              luz_coats_to_rgb  (ssim, coats, out);
-              in  += in_components;
-              out += 4;
-            }
-        }
-        else
-        {
-          while (samples--)
-            {
-              luz_coats_to_rgb  (ssim, in, out);
-              in  += in_components;
-              out += 4;
-            }
-        }
+        int coat_count = MIN (luz_get_coat_count (ssim), in_components);
+        while (samples--)
+          {
+            gfloat coats[LUZ_MAX_COATS] = {0.0f,};
+            int i;
+            for (i = 0; i < coat_count; i++)
+              coats[i] = in[i];
+            luz_coats_to_rgb_level (ssim, coats, out, level);
+            in  += in_components;
+            out += 4;
+          }
+      }
+      break;
+    case GEGL_LUZ_PROOF_ILLUMINANTS:
+    case GEGL_LUZ_METAMERISM:
+      {
+        int coat_count = MIN (luz_get_coat_count (ssim), in_components);
+        int out_components = o->mode == GEGL_LUZ_METAMERISM ? 1 :
+                               3 * luz_get_proof_illuminant_count (ssim);
+        while (samples--)
+          {
+            gfloat coats[LUZ_MAX_COATS] = {0.0f,};
+            int i;
+            for (i = 0; i < coat_count; i++)
+              coats[i] = in[i];
+            if (o->mode == GEGL_LUZ_METAMERISM)
+              out[0] = luz_coats_metamerism (ssim, coats);
+            else
+              luz_coats_to_rgb_multi (ssim, coats, out);
+            in  += in_components;
+            out += out_components;
+          }
+      }
+      break;
+    case GEGL_LUZ_SEPARATE_SPECTRAL:
+      {
+        int coat_count = MAX (1, luz_get_coat_count (ssim));
+        gfloat reflectance[64 * LUZ_SPECTRUM_BANDS];
+        while (samples > 0)
+          {
+            int chunk = MIN (samples, 64);
+            int i;
+            for (i = 0; i < chunk; i++)
+              luz_spectrum_resample (in + i * in_components, in_components,
+                                     o->spectral_start, o->spectral_gap,
+                                     reflectance + i * LUZ_SPECTRUM_BANDS);
+            luz_spectrum_to_coats (ssim, reflectance, out, chunk);
+            in  += chunk * in_components;
+            out += chunk * coat_count;
+            samples -= chunk;
+          }
       }
       break;
     case GEGL_LUZ_SEPARATE:
-      /* eeek hard coded for rgba output */
-    if (o->coat_no == 0)
+    if (o->coat_no == 0 && o->coat_format == GEGL_LUZ_COATS_U16)
+      {
+        int coat_count = luz_get_coat_count (ssim);
+        guint16 *out16 = out_buf;
+        while (samples--)
+          {
+            int i;
+            gfloat coats[LUZ_MAX_COATS];
+            luz_rgb_to_coats_level (ssim, in, coats, level);
+            for (i = 0; i < coat_count; i++)
+              out16[i] = CLAMP (coats[i], 0.0f, 1.0f) * 65535.0f + 0.5f;
+            in    += in_components;
+            out16 += coat_count;
+          }
+      }
+    else if (o->coat_no == 0 && o->coat_format == GEGL_LUZ_COATS_FLOAT)
+      while (samples--)
+        {
+          luz_rgb_to_coats_level (ssim, in, out, level);
+          in  += in_components;
+          out += luz_get_coat_count (ssim);
+        }
+    else if (o->coat_no == 0)
       while (samples--)
         {
           int i;
           int coat_count = luz_get_coat_count (ssim);
           gfloat coats[LUZ_MAX_COATS];
-          luz_rgb_to_coats (ssim, in, coats);
+          luz_rgb_to_coats_level (ssim, in, coats, level);
           for (i = 0; i < MIN(4, coat_count); i++)
             out[i] = coats[i];
           if (coat_count < 4)
@@ -183,7 +279,7 @@ process (GeglOperation       *op,
              int i;
              gfloat coats[LUZ_MAX_COATS];
 
-             luz_rgb_to_coats (ssim, in, coats);
+             luz_rgb_to_coats_level (ssim, in, coats, level);
              out[0] = coats[coat_no];
              out[1] = coats[coat_no];
              out[2] = coats[coat_no];
@@ -197,7 +293,7 @@ process (GeglOperation       *op,
         while (samples--)
         {
           gfloat coats[LUZ_MAX_COATS];
-          luz_rgb_to_coats (ssim, in, coats);
+          luz_rgb_to_coats_level (ssim, in, coats, level);
           if (o->coat_no != 0)
           {
             int coat_count = luz_get_coat_count (ssim);
@@ -206,13 +302,14 @@ process (GeglOperation       *op,
               if (i != o->coat_no - 1)
                 coats[i] = 0;
           }
-          luz_coats_to_rgb (ssim, coats, out);
+          luz_coats_to_rgb_level (ssim, coats, out, level);
 
           in  += in_components;
           out += 3;
         }
       break;
   }
+  luz_trace_end (ssim, "process");
   return TRUE;
 }
 
@@ -222,7 +319,7 @@ finalize (GObject *object)
   GeglProperties *o = GEGL_PROPERTIES (object);
   if (o->user_data)
   {
-    luz_destroy (o->user_data);
+    luz_cache_release (o->user_data);
     o->user_data = NULL;
   }
   G_OBJECT_CLASS (g_type_class_peek_parent (G_OBJECT_GET_CLASS (object)))->finalize (object);
@@ -242,7 +339,7 @@ gegl_op_class_init (GeglOpClass *klass)
   gobject_class->finalize = finalize;
   point_filter_class->process = process;
   operation_class->prepare = prepare;
-  operation_class->threaded = FALSE;
+  operation_class->threaded = TRUE;
 
   gegl_operation_class_set_keys (operation_class,
   "name"        , "gegl:luz-script",
@@ -0,0 +1,877 @@
+/* luz-separate - separate or proof images without GEGL
+ *
+ * luz is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * luz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with luz; if not, see <http://www.gnu.org/licenses/>.
+ *
+ * usage: luz-separate [options] input output
+ *
+ *   --config file     coat configuration, defaults to cyan magenta yellow
+ *   --mode mode       separate, separate-upsampled, proof, separate-proof,
+ *                     proof-illuminants or metamerism (default separate)
+ *   --threads n       worker threads, defaults to the number of cpus
+ *   --rows n          rows per band (default 64)
+ *   --depth 8|16      bits per output component (default 16)
+ *   --table file      separation table to use instead of solving, .cube or
+ *                     luz binary table as written by luz_export_table
+ *   --spectral s,g    separate a spectral image, its components being
+ *                     reflectances from s nm and every g nm after
+ *
+ * Images are streamed in bands of rows, a reader thread decodes, worker
+ * threads separate/proof and a writer thread encodes - with a bounded number
+ * of bands in flight, so memory use is independent of image height.
+ *
+ * Inputs and outputs are PNG, PPM, PGM or PAM - picked by file extension.
+ * RGB data is sRGB encoded, coat data is stored as linear coverage. When
+ * separating, an output name containing %i writes one grayscale image per
+ * coat, otherwise a single image with a component per coat is written;
+ * PNG holds at most 4 coats, PAM any number.
+ *
+ * separate-upsampled gives each RGB pixel a smooth reflectance and separates
+ * that, matching the spectrum rather than the colour under the illuminant.
+ *
+ * proof-illuminants proofs coat data under each of the proof_illuminants= of
+ * the configuration, to one RGB image per illuminant with %i in the output
+ * name, or a single PAM with 3 components per illuminant. metamerism writes
+ * a grayscale map of the CIEDE2000 change between the first and the other
+ * proof illuminants, with white at METAMERISM_MAX.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <png.h>
+#include "luz.h"
+
+#define DEFAULT_CONFIG \
+"coat1=rgb 0 1 1\n"\
+"coat1.black=rgb 0 0 0\n"\
+"coat2=rgb 1 0 1\n"\
+"coat2.black=rgb 0 0 0\n"\
+"coat3=rgb 1 1 0\n"\
+"coat3.black=rgb 0 0 0\n"
+
+enum {
+  MODE_SEPARATE,
+  MODE_PROOF,
+  MODE_SEPARATE_PROOF,
+  MODE_PROOF_ILLUMINANTS,
+  MODE_METAMERISM,
+  MODE_SEPARATE_SPECTRAL,
+  MODE_SEPARATE_UPSAMPLED
+};
+
+#define METAMERISM_MAX 10.0f
+
+enum {
+  FORMAT_PNG,
+  FORMAT_PNM, /* P5 and P6 */
+  FORMAT_PAM  /* P7 */
+};
+
+typedef struct _Image Image;
+
+struct _Image
+{
+  FILE       *file;
+  int         format;
+  int         width;
+  int         height;
+  int         components;
+  int         depth;   /* 8 or 16 */
+  png_structp png;
+  png_infop   info;
+  uint8_t    *row;     /* encoded row */
+};
+
+static int
+format_for_path (const char *path)
+{
+  const char *ext = strrchr (path, '.');
+  if (ext && !strcasecmp (ext, ".png"))
+    return FORMAT_PNG;
+  if (ext && !strcasecmp (ext, ".pam"))
+    return FORMAT_PAM;
+  return FORMAT_PNM;
+}
+
+/* reads a netpbm header token, skipping comments */
+static int
+pnm_token (FILE *file, char *token, int size)
+{
+  int c, len = 0;
+  do {
+    c = fgetc (file);
+    if (c == '#')
+      while (c != '\n' && c != EOF)
+        c = fgetc (file);
+  } while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+  while (c != EOF && c != ' ' && c != '\t' && c != '\n' && c != '\r')
+  {
+    if (len < size - 1)
+      token[len++] = c;
+    c = fgetc (file);
+  }
+  token[len] = 0;
+  return len;
+}
+
+static int
+image_open_read (Image      *image,
+                 const char *path)
+{
+  uint8_t magic[8];
+  memset (image, 0, sizeof (Image));
+  image->file = fopen (path, "rb");
+  if (!image->file)
+    return -1;
+
+  if (fread (magic, 1, 8, image->file) != 8)
+    return -1;
+
+  if (!png_sig_cmp (magic, 0, 8))
+  {
+    int color_type;
+    image->format = FORMAT_PNG;
+    image->png = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    image->info = png_create_info_struct (image->png);
+    if (setjmp (png_jmpbuf (image->png)))
+      return -1;
+    png_init_io (image->png, image->file);
+    png_set_sig_bytes (image->png, 8);
+    png_read_info (image->png, image->info);
+    color_type = png_get_color_type (image->png, image->info);
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+      png_set_palette_to_rgb (image->png);
+    if (png_get_bit_depth (image->png, image->info) < 8)
+      png_set_expand (image->png);
+    if (png_get_valid (image->png, image->info, PNG_INFO_tRNS))
+      png_set_tRNS_to_alpha (image->png);
+    png_set_interlace_handling (image->png);
+    png_read_update_info (image->png, image->info);
+    image->width = png_get_image_width (image->png, image->info);
+    image->height = png_get_image_height (image->png, image->info);
+    image->components = png_get_channels (image->png, image->info);
+    image->depth = png_get_bit_depth (image->png, image->info);
+    if (png_get_interlace_type (image->png, image->info) != PNG_INTERLACE_NONE)
+    {
+      fprintf (stderr, "luz-separate: interlaced PNG can not be streamed\n");
+      return -1;
+    }
+  }
+  else if (magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6' ||
+                               magic[1] == '7'))
+  {
+    char token[64];
+    int  maxval = 255;
+    fseek (image->file, 2, SEEK_SET);
+    if (magic[1] == '7')
+    {
+      image->format = FORMAT_PAM;
+      while (pnm_token (image->file, token, sizeof (token)) &&
+             strcmp (token, "ENDHDR"))
+      {
+        if (!strcmp (token, "WIDTH") && pnm_token (image->file, token, sizeof (token)))
+          image->width = atoi (token);
+        else if (!strcmp (token, "HEIGHT") && pnm_token (image->file, token, sizeof (token)))
+          image->height = atoi (token);
+        else if (!strcmp (token, "DEPTH") && pnm_token (image->file, token, sizeof (token)))
+          image->components = atoi (token);
+        else if (!strcmp (token, "MAXVAL") && pnm_token (image->file, token, sizeof (token)))
+          maxval = atoi (token);
+        else if (!strcmp (token, "TUPLTYPE"))
+          pnm_token (image->file, token, sizeof (token));
+      }
+    }
+    else
+    {
+      image->format = FORMAT_PNM;
+      image->components = magic[1] == '5' ? 1 : 3;
+      pnm_token (image->file, token, sizeof (token));
+      image->width = atoi (token);
+      pnm_token (image->file, token, sizeof (token));
+      image->height = atoi (token);
+      pnm_token (image->file, token, sizeof (token));
+      maxval = atoi (token);
+    }
+    if (maxval != 255 && maxval != 65535)
+    {
+      fprintf (stderr, "luz-separate: only maxval 255 and 65535 supported\n");
+      return -1;
+    }
+    image->depth = maxval == 255 ? 8 : 16;
+  }
+  else
+  {
+    fprintf (stderr, "luz-separate: %s is not a PNG or netpbm image\n", path);
+    return -1;
+  }
+
+  if (image->width <= 0 || image->height <= 0 || image->components <= 0)
+    return -1;
+  image->row = malloc (image->width * image->components * (image->depth / 8));
+  return 0;
+}
+
+/* decodes rows into floats in the 0.0-1.0 range */
+static int
+image_read_rows (Image *image,
+                 float *dst,
+                 int    rows)
+{
+  int row_samples = image->width * image->components;
+  int y, i;
+  if (image->format == FORMAT_PNG && setjmp (png_jmpbuf (image->png)))
+    return -1;
+  for (y = 0; y < rows; y++)
+  {
+    float *out = dst + y * row_samples;
+    if (image->format == FORMAT_PNG)
+      png_read_row (image->png, image->row, NULL);
+    else if (fread (image->row, image->depth / 8, row_samples, image->file) !=
+             (size_t) row_samples)
+      return -1;
+    if (image->depth == 8)
+      for (i = 0; i < row_samples; i++)
+        out[i] = image->row[i] / 255.0f;
+    else /* PNG and netpbm are both big endian */
+      for (i = 0; i < row_samples; i++)
+        out[i] = (image->row[i * 2] << 8 | image->row[i * 2 + 1]) / 65535.0f;
+  }
+  return 0;
+}
+
+static int
+image_open_write (Image      *image,
+                  const char *path,
+                  int         width,
+                  int         height,
+                  int         components,
+                  int         depth,
+                  const char *tupltype)
+{
+  memset (image, 0, sizeof (Image));
+  image->format = format_for_path (path);
+  image->width = width;
+  image->height = height;
+  image->components = components;
+  image->depth = depth;
+
+  if (image->format == FORMAT_PNG && components > 4)
+  {
+    fprintf (stderr, "luz-separate: PNG holds at most 4 components, "
+                     "write %i coats to .pam or per coat files\n", components);
+    return -1;
+  }
+  if (image->format == FORMAT_PNM && components != 1 && components != 3)
+    image->format = FORMAT_PAM;
+
+  image->file = fopen (path, "wb");
+  if (!image->file)
+    return -1;
+  image->row = malloc (width * components * (depth / 8));
+
+  switch (image->format)
+  {
+    case FORMAT_PNG:
+    {
+      static const int color_types[] = {PNG_COLOR_TYPE_GRAY,
+                                        PNG_COLOR_TYPE_GRAY_ALPHA,
+                                        PNG_COLOR_TYPE_RGB,
+                                        PNG_COLOR_TYPE_RGB_ALPHA};
+      image->png = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+      image->info = png_create_info_struct (image->png);
+      if (setjmp (png_jmpbuf (image->png)))
+        return -1;
+      png_init_io (image->png, image->file);
+      png_set_IHDR (image->png, image->info, width, height, depth,
+                    color_types[components - 1], PNG_INTERLACE_NONE,
+                    PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+      png_write_info (image->png, image->info);
+      break;
+    }
+    case FORMAT_PNM:
+      fprintf (image->file, "P%i\n%i %i\n%i\n", components == 1 ? 5 : 6,
+               width, height, depth == 8 ? 255 : 65535);
+      break;
+    case FORMAT_PAM:
+      fprintf (image->file, "P7\nWIDTH %i\nHEIGHT %i\nDEPTH %i\nMAXVAL %i\n"
+                            "TUPLTYPE %s\nENDHDR\n", width, height, components,
+               depth == 8 ? 255 : 65535, tupltype);
+      break;
+  }
+  return 0;
+}
+
+/* encodes rows, taking components starting at offset out of interleaved
+ * data with stride components per pixel */
+static int
+image_write_rows (Image       *image,
+                  const float *src,
+                  int          rows,
+                  int          stride,
+                  int          offset)
+{
+  int y, x, c;
+  if (image->format == FORMAT_PNG && setjmp (png_jmpbuf (image->png)))
+    return -1;
+  for (y = 0; y < rows; y++)
+  {
+    const float *in = src + y * image->width * stride + offset;
+    int i = 0;
+    for (x = 0; x < image->width; x++, in += stride)
+      for (c = 0; c < image->components; c++, i++)
+      {
+        float v = in[c] < 0.0f ? 0.0f : in[c] > 1.0f ? 1.0f : in[c];
+        if (image->depth == 8)
+          image->row[i] = v * 255.0f + 0.5f;
+        else
+        {
+          int v16 = v * 65535.0f + 0.5f;
+          image->row[i * 2] = v16 >> 8;
+          image->row[i * 2 + 1] = v16 & 0xff;
+        }
+      }
+    if (image->format == FORMAT_PNG)
+      png_write_row (image->png, image->row);
+    else if (fwrite (image->row, image->depth / 8, i, image->file) != (size_t) i)
+      return -1;
+  }
+  return 0;
+}
+
+static int
+image_write_end (Image *image)
+{
+  if (setjmp (png_jmpbuf (image->png)))
+    return -1;
+  png_write_end (image->png, NULL);
+  return 0;
+}
+
+static int
+image_close (Image *image,
+             int    writing)
+{
+  int ret = 0;
+  if (image->png)
+  {
+    if (writing)
+    {
+      ret = image_write_end (image);
+      png_destroy_write_struct (&image->png, &image->info);
+    }
+    else
+      png_destroy_read_struct (&image->png, &image->info, NULL);
+  }
+  if (image->file && fclose (image->file))
+    ret = -1;
+  free (image->row);
+  return ret;
+}
+
+static float srgb_to_linear_lut[65536];
+
+static inline float
+linear_to_srgb (float v)
+{
+  if (v <= 0.0031308f)
+    return v * 12.92f;
+  return 1.055f * powf (v, 1.0f / 2.4f) - 0.055f;
+}
+
+/* a band of rows moving through the pipeline */
+
+enum {
+  BAND_FREE,
+  BAND_DECODED,
+  BAND_BUSY,
+  BAND_PROCESSED
+};
+
+typedef struct _Band Band;
+
+struct _Band
+{
+  int    state;
+  int    seq;
+  int    rows;
+  float *in;
+  float *out;
+};
+
+typedef struct _Job Job;
+
+struct _Job
+{
+  Luz            *luz;
+  int             mode;
+  int             width;
+  int             height;
+  int             band_rows;
+  int             bands;     /* total bands in image */
+  int             in_components;
+  int             out_components;
+  int             coats;
+  float           spectral_start;
+  float           spectral_gap;
+
+  Image           input;
+  Image           output[LUZ_MAX_COATS];
+  int             outputs;
+
+  Band           *slots;
+  int             slot_count;
+  int             next_process;
+  int             failed;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+};
+
+static void
+process_band (Job  *job,
+              Band *band)
+{
+  int samples = band->rows * job->width;
+  const float *in = band->in;
+  float *out = band->out;
+  int i, c;
+
+  if (job->mode == MODE_SEPARATE_SPECTRAL)
+  {
+    float *reflectance = malloc (sizeof (float) * LUZ_SPECTRUM_BANDS * samples);
+    for (i = 0; i < samples; i++)
+      luz_spectrum_resample (in + i * job->in_components, job->in_components,
+                             job->spectral_start, job->spectral_gap,
+                             reflectance + i * LUZ_SPECTRUM_BANDS);
+    luz_spectrum_to_coats (job->luz, reflectance, out, samples);
+    free (reflectance);
+    return;
+  }
+  if (job->mode == MODE_SEPARATE_UPSAMPLED)
+  {
+    float *reflectance = malloc (sizeof (float) * LUZ_SPECTRUM_BANDS * samples);
+    float *rgb = malloc (sizeof (float) * 3 * samples);
+    for (i = 0; i < samples; i++)
+      for (c = 0; c < 3; c++)
+        rgb[i * 3 + c] = in[i * job->in_components +
+                            (job->in_components >= 3 ? c : 0)];
+    luz_rgb_to_reflectance (job->luz, rgb, reflectance, samples);
+    luz_spectrum_to_coats (job->luz, reflectance, out, samples);
+    free (rgb);
+    free (reflectance);
+    return;
+  }
+
+  for (i = 0; i < samples; i++)
+  {
+    float rgb[3];
+    float coats[LUZ_MAX_COATS] = {0.0f,};
+
+    switch (job->mode)
+    {
+      case MODE_SEPARATE:
+        for (c = 0; c < 3; c++)
+          rgb[c] = in[job->in_components >= 3 ? c : 0];
+        luz_rgb_to_coats (job->luz, rgb, out);
+        break;
+      case MODE_PROOF:
+        for (c = 0; c < job->coats && c < job->in_components; c++)
+          coats[c] = in[c];
+        luz_coats_to_rgb (job->luz, coats, out);
+        break;
+      case MODE_SEPARATE_PROOF:
+        for (c = 0; c < 3; c++)
+          rgb[c] = in[job->in_components >= 3 ? c : 0];
+        luz_rgb_to_coats (job->luz, rgb, coats);
+        luz_coats_to_rgb (job->luz, coats, out);
+        break;
+      case MODE_PROOF_ILLUMINANTS:
+        for (c = 0; c < job->coats && c < job->in_components; c++)
+          coats[c] = in[c];
+        luz_coats_to_rgb_multi (job->luz, coats, out);
+        break;
+      case MODE_METAMERISM:
+        for (c = 0; c < job->coats && c < job->in_components; c++)
+          coats[c] = in[c];
+        out[0] = luz_coats_metamerism (job->luz, coats) / METAMERISM_MAX;
+        break;
+    }
+    if (job->mode != MODE_SEPARATE && job->mode != MODE_METAMERISM)
+      for (c = 0; c < job->out_components; c++)
+        out[c] = linear_to_srgb (out[c]);
+    in += job->in_components;
+    out += job->out_components;
+  }
+}
+
+static void *
+reader_thread (void *data)
+{
+  Job *job = data;
+  int seq;
+  for (seq = 0; seq < job->bands; seq++)
+  {
+    Band *band = &job->slots[seq % job->slot_count];
+    int rows = job->height - seq * job->band_rows;
+    int failed;
+    if (rows > job->band_rows)
+      rows = job->band_rows;
+
+    pthread_mutex_lock (&job->mutex);
+    while (band->state != BAND_FREE && !job->failed)
+      pthread_cond_wait (&job->cond, &job->mutex);
+    failed = job->failed;
+    pthread_mutex_unlock (&job->mutex);
+    if (failed)
+      break;
+
+    failed = image_read_rows (&job->input, band->in, rows);
+    if (!failed && (job->mode == MODE_SEPARATE ||
+                    job->mode == MODE_SEPARATE_UPSAMPLED ||
+                    job->mode == MODE_SEPARATE_PROOF))
+    {
+      int i, c;
+      int n = rows * job->width * job->in_components;
+      int colour = job->in_components >= 3 ? 3 : 1; /* alpha stays linear */
+      for (i = 0; i < n; i += job->in_components)
+        for (c = 0; c < colour; c++)
+          band->in[i + c] =
+            srgb_to_linear_lut[(int)(band->in[i + c] * 65535.0f + 0.5f)];
+    }
+
+    pthread_mutex_lock (&job->mutex);
+    if (failed)
+    {
+      fprintf (stderr, "luz-separate: read error\n");
+      job->failed = 1;
+    }
+    band->seq = seq;
+    band->rows = rows;
+    band->state = BAND_DECODED;
+    pthread_cond_broadcast (&job->cond);
+    pthread_mutex_unlock (&job->mutex);
+  }
+  return NULL;
+}
+
+static void *
+worker_thread (void *data)
+{
+  Job *job = data;
+  for (;;)
+  {
+    Band *band;
+    pthread_mutex_lock (&job->mutex);
+    for (;;)
+    {
+      if (job->failed || job->next_process >= job->bands)
+      {
+        pthread_mutex_unlock (&job->mutex);
+        return NULL;
+      }
+      band = &job->slots[job->next_process % job->slot_count];
+      if (band->state == BAND_DECODED && band->seq == job->next_process)
+        break;
+      pthread_cond_wait (&job->cond, &job->mutex);
+    }
+    band->state = BAND_BUSY;
+    job->next_process++;
+    pthread_mutex_unlock (&job->mutex);
+
+    process_band (job, band);
+
+    pthread_mutex_lock (&job->mutex);
+    band->state = BAND_PROCESSED;
+    pthread_cond_broadcast (&job->cond);
+    pthread_mutex_unlock (&job->mutex);
+  }
+}
+
+static void *
+writer_thread (void *data)
+{
+  Job *job = data;
+  int seq;
+  for (seq = 0; seq < job->bands; seq++)
+  {
+    Band *band = &job->slots[seq % job->slot_count];
+    int failed = 0;
+    int i;
+
+    pthread_mutex_lock (&job->mutex);
+    while (!(band->state == BAND_PROCESSED && band->seq == seq) && !job->failed)
+      pthread_cond_wait (&job->cond, &job->mutex);
+    failed = job->failed;
+    pthread_mutex_unlock (&job->mutex);
+    if (failed)
+      break;
+
+    for (i = 0; i < job->outputs && !failed; i++)
+      failed = image_write_rows (&job->output[i], band->out, band->rows,
+                                 job->out_components,
+                                 i * job->output[i].components);
+
+    pthread_mutex_lock (&job->mutex);
+    if (failed)
+    {
+      fprintf (stderr, "luz-separate: write error\n");
+      job->failed = 1;
+    }
+    band->state = BAND_FREE;
+    pthread_cond_broadcast (&job->cond);
+    pthread_mutex_unlock (&job->mutex);
+  }
+  return NULL;
+}
+
+static char *
+read_file (const char *path)
+{
+  FILE *file = fopen (path, "rb");
+  char *data;
+  long  length;
+  if (!file)
+    return NULL;
+  fseek (file, 0, SEEK_END);
+  length = ftell (file);
+  fseek (file, 0, SEEK_SET);
+  data = calloc (length + 1, 1);
+  if (fread (data, 1, length, file) != (size_t)length)
+    length = 0;
+  data[length] = 0;
+  fclose (file);
+  return data;
+}
+
+static void
+usage (const char *argv0)
+{
+  fprintf (stderr, "usage: %s [--config file] [--mode separate|separate-upsampled|\n"
+                   "          proof|separate-proof|proof-illuminants|metamerism]\n"
+                   "          [--threads n] [--rows n] [--depth 8|16] [--table file]\n"
+                   "          [--spectral start,gap]\n"
+                   "          input output\n",
+           argv0);
+}
+
+int main (int argc, char **argv)
+{
+  Job         job;
+  const char *config_path = NULL;
+  const char *table_path = NULL;
+  const char *input_path = NULL;
+  const char *output_path = NULL;
+  char       *config = NULL;
+  int         threads = sysconf (_SC_NPROCESSORS_ONLN);
+  int         depth = 16;
+  pthread_t   reader, writer, workers[256];
+  int i;
+
+  memset (&job, 0, sizeof (job));
+  job.mode = MODE_SEPARATE;
+  job.band_rows = 64;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (!strcmp (argv[i], "--config") && i + 1 < argc)
+      config_path = argv[++i];
+    else if (!strcmp (argv[i], "--mode") && i + 1 < argc)
+    {
+      i++;
+      if (!strcmp (argv[i], "separate"))
+        job.mode = MODE_SEPARATE;
+      else if (!strcmp (argv[i], "separate-upsampled"))
+        job.mode = MODE_SEPARATE_UPSAMPLED;
+      else if (!strcmp (argv[i], "proof"))
+        job.mode = MODE_PROOF;
+      else if (!strcmp (argv[i], "separate-proof"))
+        job.mode = MODE_SEPARATE_PROOF;
+      else if (!strcmp (argv[i], "proof-illuminants"))
+        job.mode = MODE_PROOF_ILLUMINANTS;
+      else if (!strcmp (argv[i], "metamerism"))
+        job.mode = MODE_METAMERISM;
+      else
+      {
+        usage (argv[0]);
+        return 1;
+      }
+    }
+    else if (!strcmp (argv[i], "--threads") && i + 1 < argc)
+      threads = atoi (argv[++i]);
+    else if (!strcmp (argv[i], "--rows") && i + 1 < argc)
+      job.band_rows = atoi (argv[++i]);
+    else if (!strcmp (argv[i], "--spectral") && i + 1 < argc)
+    {
+      job.mode = MODE_SEPARATE_SPECTRAL;
+      if (sscanf (argv[++i], "%f,%f", &job.spectral_start,
+                  &job.spectral_gap) != 2 || job.spectral_gap <= 0.0f)
+      {
+        usage (argv[0]);
+        return 1;
+      }
+    }
+    else if (!strcmp (argv[i], "--table") && i + 1 < argc)
+      table_path = argv[++i];
+    else if (!strcmp (argv[i], "--depth") && i + 1 < argc)
+      depth = atoi (argv[++i]) == 8 ? 8 : 16;
+    else if (argv[i][0] != '-' && !input_path)
+      input_path = argv[i];
+    else if (argv[i][0] != '-' && !output_path)
+      output_path = argv[i];
+    else
+    {
+      usage (argv[0]);
+      return 1;
+    }
+  }
+  if (!input_path || !output_path)
+  {
+    usage (argv[0]);
+    return 1;
+  }
+  if (threads < 1)
+    threads = 1;
+  if (threads > 256)
+    threads = 256;
+  if (job.band_rows < 1)
+    job.band_rows = 1;
+
+  if (config_path && !(config = read_file (config_path)))
+  {
+    fprintf (stderr, "luz-separate: failed to read %s\n", config_path);
+    return 1;
+  }
+  job.luz = luz_new (config ? config : DEFAULT_CONFIG);
+  job.coats = luz_get_coat_count (job.luz);
+  if (table_path && luz_import_table (job.luz, table_path))
+  {
+    fprintf (stderr, "luz-separate: failed to load table %s\n", table_path);
+    return 1;
+  }
+
+  for (i = 0; i < 65536; i++)
+  {
+    float v = i / 65535.0f;
+    srgb_to_linear_lut[i] = v <= 0.04045f ? v / 12.92f :
+                                            powf ((v + 0.055f) / 1.055f, 2.4f);
+  }
+
+  if (image_open_read (&job.input, input_path))
+  {
+    fprintf (stderr, "luz-separate: failed to open %s\n", input_path);
+    return 1;
+  }
+  job.width = job.input.width;
+  job.height = job.input.height;
+  job.in_components = job.input.components;
+  switch (job.mode)
+  {
+    case MODE_SEPARATE:
+    case MODE_SEPARATE_SPECTRAL:
+    case MODE_SEPARATE_UPSAMPLED:
+      job.out_components = job.coats;
+      break;
+    case MODE_PROOF_ILLUMINANTS:
+      job.out_components = 3 * luz_get_proof_illuminant_count (job.luz);
+      break;
+    case MODE_METAMERISM:
+      job.out_components = 1;
+      break;
+    default:
+      job.out_components = 3;
+      break;
+  }
+  job.bands = (job.height + job.band_rows - 1) / job.band_rows;
+
+  if ((job.mode == MODE_SEPARATE || job.mode == MODE_SEPARATE_SPECTRAL ||
+       job.mode == MODE_SEPARATE_UPSAMPLED ||
+       job.mode == MODE_PROOF_ILLUMINANTS) && strstr (output_path, "%i"))
+  {
+    int components = job.mode == MODE_PROOF_ILLUMINANTS ? 3 : 1;
+    const char *number = strstr (output_path, "%i");
+    job.outputs = job.out_components / components;
+    for (i = 0; i < job.outputs; i++)
+    { /* the name is not a format, only the first %i is replaced */
+      char path[4096];
+      snprintf (path, sizeof (path), "%.*s%i%s", (int) (number - output_path),
+                output_path, i + 1, number + 2);
+      if (image_open_write (&job.output[i], path, job.width, job.height,
+                            components, depth,
+                            components == 1 ? "GRAYSCALE" : "RGB"))
+      {
+        fprintf (stderr, "luz-separate: failed to open %s\n", path);
+        return 1;
+      }
+    }
+  }
+  else
+  {
+    if (image_open_write (&job.output[0], output_path, job.width, job.height,
+                          job.out_components, depth,
+                          job.mode == MODE_SEPARATE ||
+                          job.mode == MODE_SEPARATE_SPECTRAL ||
+                          job.mode == MODE_SEPARATE_UPSAMPLED ? "LUZ_COATS" :
+                          job.mode == MODE_METAMERISM ? "GRAYSCALE" :
+                          job.out_components == 3 ? "RGB" : "LUZ_RGB_SET"))
+    {
+      fprintf (stderr, "luz-separate: failed to open %s\n", output_path);
+      return 1;
+    }
+    job.outputs = 1;
+  }
+
+  /* enough bands for every worker to have one while the reader and
+   * writer each work on another */
+  job.slot_count = threads + 2;
+  job.slots = calloc (sizeof (Band), job.slot_count);
+  for (i = 0; i < job.slot_count; i++)
+  {
+    job.slots[i].in = malloc (sizeof (float) * job.band_rows * job.width *
+                              job.in_components);
+    job.slots[i].out = malloc (sizeof (float) * job.band_rows * job.width *
+                               job.out_components);
+  }
+  pthread_mutex_init (&job.mutex, NULL);
+  pthread_cond_init (&job.cond, NULL);
+
+  pthread_create (&reader, NULL, reader_thread, &job);
+  pthread_create (&writer, NULL, writer_thread, &job);
+  for (i = 0; i < threads; i++)
+    pthread_create (&workers[i], NULL, worker_thread, &job);
+
+  pthread_join (reader, NULL);
+  for (i = 0; i < threads; i++)
+    pthread_join (workers[i], NULL);
+  pthread_join (writer, NULL);
+
+  image_close (&job.input, 0);
+  for (i = 0; i < job.outputs; i++)
+    if (image_close (&job.output[i], 1))
+      job.failed = 1;
+
+  for (i = 0; i < job.slot_count; i++)
+  {
+    free (job.slots[i].in);
+    free (job.slots[i].out);
+  }
+  free (job.slots);
+  luz_destroy (job.luz);
+  free (config);
+  return job.failed;
+}
@@ -40,8 +40,18 @@ property_enum (mode, _("Mode"), GeglInkSimMode2, count_sim_mode,
                  GEGL_SSIM_SEPARATE_PROOF)
   description (_("how the coat simulator is used"))
 
+enum_start (count_coat_format)
+  enum_value (GEGL_SSIM_COATS_RGBA,  "rgba",  N_("RGBA"))
+  enum_value (GEGL_SSIM_COATS_FLOAT, "float", N_("Float per coat"))
+  enum_value (GEGL_SSIM_COATS_U16,   "u16",   N_("u16 per coat"))
+enum_end (GeglLuzCoatFormat2)
+
+property_enum (coat_format, _("Coat format"), GeglLuzCoatFormat2, count_coat_format,
+                 GEGL_SSIM_COATS_RGBA)
+  description (_("pixel format of separations, rgba holds up to 4 coats, the other formats have one component per coat"))
+
   property_int (coat_no, _("coat no"), 0)
-              value_range (0, 5)
+              value_range (0, 16)
               description (_("0 means all coat, a specific number means show output for only that color - when separating this causes a grayscale to be produced"))
 
 #ifdef USE_UI
@@ -119,30 +129,6 @@ prepare (GeglOperation *operation)
   if (input_format)
     input_components = babl_format_get_n_components (input_format);
 
-  switch (o->mode)
-  {
-    case GEGL_SSIM_PROOF:
-      gegl_operation_set_format (operation, "input",
-        babl_format_n (babl_type("float"), input_components));
-      gegl_operation_set_format (operation, "output", babl_format ("RGBA float"));
-      break;
-    case GEGL_SSIM_SEPARATE:
-      //gegl_operation_set_format (operation, "output",
-      //  babl_format_n (babl_type("float"), luz_get_coat_count (o->user_data)));
-      gegl_operation_set_format (operation, "output", babl_format ("RGBA float"));
-
-      gegl_operation_set_format (operation, "input",
-          babl_format ("RGBA float"));
-      break;
-    default:
-    case GEGL_SSIM_SEPARATE_PROOF:
-      gegl_operation_set_format (operation, "output", babl_format ("RGB float"));
-
-      gegl_operation_set_format (operation, "input",
-          babl_format ("RGBA float"));
-      break;
-  }
-
 #ifdef USE_UI
   {
   float color[4];
@@ -209,17 +195,43 @@ prepare (GeglOperation *operation)
   g_string_append_printf (conf_str, "iterations=%f\n", o->iterations);
   g_string_append_printf (conf_str, "\n");
 
-  if (o->user_data)
-    luz_destroy (o->user_data);
-  o->user_data = luz_new (conf_str->str);
+  o->user_data = luz_cache_get (conf_str->str, o->user_data);
 
   g_string_free (conf_str, TRUE);
   }
 #else
-  if (o->user_data)
-    luz_destroy (o->user_data);
-  o->user_data = luz_new (o->config);
+  o->user_data = luz_cache_get (o->config, o->user_data);
 #endif
+  luz_trace_begin (o->user_data, "prepare");
+
+  switch (o->mode)
+  {
+    case GEGL_SSIM_PROOF:
+      gegl_operation_set_format (operation, "input",
+        babl_format_n (babl_type("float"), input_components));
+      gegl_operation_set_format (operation, "output", babl_format ("RGBA float"));
+      break;
+    case GEGL_SSIM_SEPARATE:
+      if (o->coat_format != GEGL_SSIM_COATS_RGBA && o->coat_no == 0)
+        gegl_operation_set_format (operation, "output",
+          babl_format_n (babl_type (o->coat_format == GEGL_SSIM_COATS_U16 ?
+                                    "u16" : "float"),
+                         MAX (1, luz_get_coat_count (o->user_data))));
+      else
+        gegl_operation_set_format (operation, "output", babl_format ("RGBA float"));
+
+      gegl_operation_set_format (operation, "input",
+          babl_format ("RGBA float"));
+      break;
+    default:
+    case GEGL_SSIM_SEPARATE_PROOF:
+      gegl_operation_set_format (operation, "output", babl_format ("RGB float"));
+
+      gegl_operation_set_format (operation, "input",
+          babl_format ("RGBA float"));
+      break;
+  }
+  luz_trace_end (o->user_data, "prepare");
 }
 
 static gboolean
@@ -237,43 +249,55 @@ process (GeglOperation       *op,
   int in_components =
     babl_format_get_n_components (gegl_operation_get_format (op, "input"));
 
+  luz_trace_begin (ssim, "process");
+
   switch (o->mode)
   {
     case GEGL_SSIM_PROOF:
       {
-        if (luz_get_coat_count (ssim) > 3)
-        {
-          while (samples--)
-            {
-              gfloat coats[4];
-              int i;
-              for (i = 0; i < 4; i++)
-                coats[i] = in[i];
-              luz_coats_to_rgb (ssim, coats, out);
-              in  += in_components;
-              out += 4;
-            }
-        }
-        else
-        {
-          while (samples--)
-            {
-              luz_coats_to_rgb (ssim, in, out);
-              in  += in_components;
-              out += 4;
-            }
-        }
+        int coat_count = MIN (luz_get_coat_count (ssim), in_components);
+        while (samples--)
+          {
+            gfloat coats[LUZ_MAX_COATS] = {0.0f,};
+            int i;
+            for (i = 0; i < coat_count; i++)
+              coats[i] = in[i];
+            luz_coats_to_rgb_level (ssim, coats, out, level);
+            in  += in_components;
+            out += 4;
+          }
       }
       break;
     case GEGL_SSIM_SEPARATE:
-      /* eeek hard coded for rgb output */
-    if (o->coat_no == 0)
+    if (o->coat_no == 0 && o->coat_format == GEGL_SSIM_COATS_U16)
+      {
+        int coat_count = luz_get_coat_count (ssim);
+        guint16 *out16 = out_buf;
+        while (samples--)
+          {
+            int i;
+            gfloat coats[LUZ_MAX_COATS];
+            luz_rgb_to_coats_level (ssim, in, coats, level);
+            for (i = 0; i < coat_count; i++)
+              out16[i] = CLAMP (coats[i], 0.0f, 1.0f) * 65535.0f + 0.5f;
+            in    += in_components;
+            out16 += coat_count;
+          }
+      }
+    else if (o->coat_no == 0 && o->coat_format == GEGL_SSIM_COATS_FLOAT)
+      while (samples--)
+        {
+          luz_rgb_to_coats_level (ssim, in, out, level);
+          in  += in_components;
+          out += luz_get_coat_count (ssim);
+        }
+    else if (o->coat_no == 0)
       while (samples--)
         {
           int i;
           int count_count = luz_get_coat_count (ssim);
           gfloat coats[LUZ_MAX_COATS];
-          luz_rgb_to_coats (ssim, in, coats);
+          luz_rgb_to_coats_level (ssim, in, coats, level);
           for (i = 0; i < MIN(4, count_count); i++)
             out[i] = coats[i];
           if (count_count < 4)
@@ -296,7 +320,7 @@ process (GeglOperation       *op,
              int i;
              gfloat coats[LUZ_MAX_COATS];
 
-             luz_rgb_to_coats (ssim, in, coats);
+             luz_rgb_to_coats_level (ssim, in, coats, level);
              out[0] = coats[count_no];
              out[1] = coats[count_no];
              out[2] = coats[count_no];
@@ -310,7 +334,7 @@ process (GeglOperation       *op,
         while (samples--)
         {
           gfloat coats[LUZ_MAX_COATS];
-          luz_rgb_to_coats (ssim, in, coats);
+          luz_rgb_to_coats_level (ssim, in, coats, level);
           if (o->coat_no != 0)
           {
             int count_count = luz_get_coat_count (ssim);
@@ -319,13 +343,14 @@ process (GeglOperation       *op,
               if (i != o->coat_no - 1)
                 coats[i] = 0;
           }
-          luz_coats_to_rgb (ssim, coats, out);
+          luz_coats_to_rgb_level (ssim, coats, out, level);
 
           in  += in_components;
           out += 3;
         }
       break;
   }
+  luz_trace_end (ssim, "process");
   return TRUE;
 }
 
@@ -335,7 +360,7 @@ finalize (GObject *object)
   GeglProperties *o = GEGL_PROPERTIES (object);
   if (o->user_data)
   {
-    luz_destroy (o->user_data);
+    luz_cache_release (o->user_data);
     o->user_data = NULL;
   }
   G_OBJECT_CLASS (g_type_class_peek_parent (G_OBJECT_GET_CLASS (object)))->finalize (object);
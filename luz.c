@@ -17,14 +17,16 @@
  * Copyright 2014, 2016, 2018 Øyvind Kolås <pippin@gimp.org>
  */
 
-#include <babl/babl.h>
 #include "luz.h"
 #include <math.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
 
 /* this defines the dimensions of the spectrums used for computations,
    when spectrums are defined in the text configuration environment, they
@@ -34,19 +36,24 @@
 #define INCREMENT        0.1
 
 #define SPECTRUM_DB_SIZE 384  /* number of named spectrums to store */
-#define LUT_DIM          16
+#define LUT_DIM          16   /* default, configurable with lutdim */
+#define LUT_DIM_MAX      65
 
 #include "luz-config.inc"
 
 
 #ifndef CLAMP
-#define CLAMP(a,b,c) ((a)<(b)?(b):(a)>(c)?(c):(c))
+#define CLAMP(a,b,c) ((a)<(b)?(b):(a)>(c)?(c):(a))
 #endif
 
 #ifndef MAX
 #define MAX(a,b) ((a)>(b)?(a):(b))
 #endif
 
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+
 typedef struct _Coat     Coat;
 
 enum {
@@ -76,10 +83,305 @@ struct _Coat {
 
 typedef struct _InkMix InkMix;
 
+/* states of InkMix.defined */
+enum {
+  LUZ_CELL_UNDEFINED = 0,
+  LUZ_CELL_DEFINED   = 1,
+  LUZ_CELL_BUSY      = 2, /* being computed by another thread */
+  LUZ_CELL_STALE     = 3  /* level holds a solution for a previous
+                             configuration, used as warm start */
+};
+
 struct _InkMix
 {
   int32_t defined;
   float   level[LUZ_MAX_COATS];
+  float   residual; /* CIEDE2000 from the colour solved for, -1 unknown */
+};
+
+/* the separation tables, by the colour space indexing them */
+typedef enum {
+  LUZ_SPACE_RGB = 0, /* linear RGB, 0.0 - 1.0 */
+  LUZ_SPACE_LAB = 1  /* CIE Lab, L 0 - 100 and a, b -LAB_AB_RANGE to
+                        LAB_AB_RANGE; perceptually even steps */
+} LuzSpace;
+
+#define LAB_AB_RANGE 128.0f
+
+/* how cells are solved, solver= in the configuration; the population
+ * solver is tuned with population= and generations=
+ */
+typedef enum {
+  LUZ_SOLVER_WALK       = 0, /* exhaustive grid, then a random walk */
+  LUZ_SOLVER_POPULATION = 1  /* differential evolution */
+} LuzSolver;
+
+/* what the solvers minimise, objective= in the configuration */
+typedef enum {
+  LUZ_OBJECTIVE_RGB    = 0, /* squared linear RGB difference */
+  LUZ_OBJECTIVE_DE76   = 1, /* squared CIE76 delta E */
+  LUZ_OBJECTIVE_DE2000 = 2  /* squared CIEDE2000 */
+} LuzObjective;
+
+/* how the black coat follows the grey component, black_generation= */
+typedef enum {
+  LUZ_BLACK_GCR = 0, /* grey component replacement, in any colour */
+  LUZ_BLACK_UCR = 1  /* under colour removal, fading out with saturation */
+} LuzBlackGeneration;
+
+/* how much of the derived state a configuration change invalidates */
+typedef enum {
+  LUZ_DIRTY_NONE = 0,
+  LUZ_DIRTY_WARM = 1, /* forward model or solver tuning changed, old
+                         solutions remain good starting points */
+  LUZ_DIRTY_FULL = 2  /* the set of coats changed, discard solutions */
+} LuzDirty;
+
+/* counters are spread over cache line sized shards, each thread updating
+ * its own, and summed when read.
+ */
+#define LUZ_STATS_SHARDS 16
+
+typedef struct _LuzStatsShard LuzStatsShard;
+
+struct _LuzStatsShard
+{
+  LuzStats counters;
+} __attribute__ ((aligned (128)));
+
+static int32_t luz_stats_next_shard = 0;
+static __thread int32_t luz_stats_shard = -1;
+
+#define LUZ_STAT_ADD(luz, counter, n) \
+  __atomic_fetch_add (&luz_stats_get_shard (luz)->counters.counter, (n), \
+                      __ATOMIC_RELAXED)
+
+/* tracing, events are appended to per thread buffers without locking, and
+ * written out as chrome trace json (chrome://tracing, perfetto) when the
+ * instance is destroyed or released from the cache. Disabled tracing costs
+ * a NULL check.
+ */
+#define LUZ_TRACE_MAX_EVENTS (1024 * 1024) /* per thread */
+
+typedef struct _LuzTraceEvent  LuzTraceEvent;
+typedef struct _LuzTraceBuffer LuzTraceBuffer;
+typedef struct _LuzTrace       LuzTrace;
+
+struct _LuzTraceEvent
+{
+  const char *name;  /* static strings only */
+  uint64_t    ts_ns;
+  int32_t     arg;
+  char        phase; /* 'B' or 'E' */
+};
+
+struct _LuzTraceBuffer
+{
+  LuzTraceBuffer *next;
+  int32_t         tid;
+  int32_t         count;
+  int32_t         capacity;
+  int32_t         dropped;
+  LuzTraceEvent  *events;
+};
+
+struct _LuzTrace
+{
+  uint64_t        serial;   /* unique per trace, for the thread local cache */
+  char           *path;
+  uint64_t        start_ns;
+  LuzTraceBuffer *buffers;  /* pushed with compare and swap */
+};
+
+static uint64_t luz_trace_next_serial = 0;
+static int32_t  luz_trace_next_tid = 0;
+static __thread int32_t         luz_trace_tid = 0;
+static __thread uint64_t        luz_trace_tls_serial = 0;
+static __thread LuzTraceBuffer *luz_trace_tls_buffer = NULL;
+
+/* memo of direct solves, for targets that do not fit the separation table;
+ * keyed by a quantised projection of the target, split in shards with their
+ * own lock, each a hash table with its entries on a least recently used
+ * list that is recycled from the old end when full.
+ */
+#define LUZ_MEMO_SHARDS  16
+#define LUZ_MEMO_KEY     (1 + LUZ_SPECTRUM_BANDS) /* kind, and values */
+#define LUZ_MEMO_DEFAULT 65536
+
+enum {
+  LUZ_MEMO_SPECTRUM = 1,
+  LUZ_MEMO_RGB      = 2
+};
+
+typedef struct _LuzMemoEntry LuzMemoEntry;
+typedef struct _LuzMemoShard LuzMemoShard;
+typedef struct _LuzMemo      LuzMemo;
+
+struct _LuzMemoEntry
+{
+  uint16_t key[LUZ_MEMO_KEY];
+  int32_t  chain;  /* next entry in the same bucket, or -1 */
+  int32_t  newer;  /* neighbours on the lru list, or -1 */
+  int32_t  older;
+  float    level[LUZ_MAX_COATS];
+};
+
+struct _LuzMemoShard
+{
+  pthread_mutex_t mutex;
+  int32_t        *bucket;   /* capacity heads, -1 when empty */
+  LuzMemoEntry   *entry;
+  int32_t         capacity;
+  int32_t         used;
+  int32_t         newest;
+  int32_t         oldest;
+} __attribute__ ((aligned (128)));
+
+struct _LuzMemo
+{
+  LuzMemoShard shard[LUZ_MEMO_SHARDS];
+  int32_t      entries;
+};
+
+/* the coat levels of a lattice over the coat space, with their colour in
+ * the objective's coordinates, ordered as an implicit k-d tree - the median
+ * of a range is its node, and splits on axis depth % 3. Solves start from
+ * the samples nearest to their target instead of searching the lattice.
+ * Coats with discrete levels= are sampled at their levels, when all coats
+ * are the lattice holds every printable combination - the Neugebauer
+ * primaries - and solves pick among them, see luz_discrete.
+ */
+#define LUZ_SEEDS_MAX     (1 << 18) /* samples, coarser lattices above */
+#define LUZ_SEEDS_DEFAULT 8
+#define LUZ_SEEDS_COATS   5  /* coat count from which the walk is seeded */
+#define LUZ_SEEDS_K_MAX   16
+
+/* states of structures built by the first thread needing them */
+enum {
+  LUZ_BUILD_NONE  = 0,
+  LUZ_BUILD_BUSY  = 1,
+  LUZ_BUILD_READY = 2
+};
+
+typedef struct _LuzSeeds LuzSeeds;
+
+struct _LuzSeeds
+{
+  int32_t count;
+  int32_t coats;
+  float  *coords; /* 3 per sample */
+  float  *level;  /* coats per sample */
+};
+
+/* the adaptive separation table, table=adaptive - an octree over RGB with
+ * coat levels solved at the corners of its nodes, leaves are interpolated
+ * like the cells of the uniform table. Nodes that interpolate their centre
+ * well are left unsplit, so smooth parts of the gamut get big leaves and
+ * the boundary and shadows small ones.
+ */
+#define LUZ_OCTREE_BASE   2  /* depth split regardless of residuals */
+#define LUZ_OCTREE_DEPTH  5  /* deepest leaves, 32 per axis */
+#define LUZ_OCTREE_SIDE   ((1 << LUZ_OCTREE_DEPTH) + 1)
+#define LUZ_OCTREE_NODES  (17 * 17 * 17) /* default table_nodes= */
+
+typedef enum {
+  LUZ_TABLE_UNIFORM  = 0,
+  LUZ_TABLE_ADAPTIVE = 1
+} LuzTable;
+
+typedef struct _LuzOctreeNode LuzOctreeNode;
+typedef struct _LuzOctree     LuzOctree;
+
+struct _LuzOctreeNode
+{
+  int32_t child;     /* first of the 8 children, in octant order, or 0 */
+  int32_t corner[8]; /* vertices, numbered as in lut_interpolate */
+};
+
+struct _LuzOctree
+{
+  LuzOctreeNode *node; /* the root first */
+  int32_t        nodes;
+  float         *level; /* coats per vertex */
+  int32_t        vertices;
+  int32_t        coats;
+};
+
+/* the gamut boundary, as segment maxima - Lab is divided in segments of
+ * hue and elevation angle around a neutral centre, each holding the
+ * distance of the furthest forward sample in it. Between segment centres
+ * the boundary is interpolated, making the in gamut test a constant time
+ * lookup. The RGB cube is described the same way, for compressing the
+ * colours between the two boundaries.
+ */
+#define LUZ_GAMUT_HUES       36
+#define LUZ_GAMUT_ELEVATIONS 18
+#define LUZ_GAMUT_SAMPLES    (1 << 18) /* forward samples, at most */
+#define LUZ_GAMUT_KNEE       0.8f /* share of the boundary distance left
+                                     alone by gamutmap=compress */
+
+/* how targets outside the gamut are moved before solving, gamutmap= */
+typedef enum {
+  LUZ_GAMUT_MAP_NONE     = 0, /* left to the solver */
+  LUZ_GAMUT_MAP_CLIP     = 1, /* to the boundary, towards the centre */
+  LUZ_GAMUT_MAP_COMPRESS = 2  /* the outer part of the RGB cube squeezed
+                                 into the outer part of the gamut */
+} LuzGamutMap;
+
+typedef struct _LuzGamut LuzGamut;
+
+struct _LuzGamut
+{
+  float centre[3]; /* Lab, halfway between the lightest and darkest */
+  float radius[LUZ_GAMUT_ELEVATIONS][LUZ_GAMUT_HUES]; /* of the coats */
+  float source[LUZ_GAMUT_ELEVATIONS][LUZ_GAMUT_HUES]; /* of the RGB cube */
+};
+
+/* the hues of the coats printed alone, for subsets= */
+typedef struct _LuzHues LuzHues;
+
+struct _LuzHues
+{
+  float    hue[LUZ_MAX_COATS];   /* of the chromatic coats, radians */
+  int32_t  order[LUZ_MAX_COATS]; /* chromatic coats by increasing hue */
+  int32_t  count;                /* chromatic coats */
+  uint32_t neutral;              /* coats of low chroma, like black */
+  uint32_t spread;               /* three chromatic coats most evenly
+                                    spread around the hue circle */
+};
+
+/* smooth reflectances for RGB colours - a reflectance S(c0 t^2 + c1 t + c2),
+ * with t the position of the band from 0.0 to 1.0 and S a sigmoid onto 0.0
+ * to 1.0, has no edges and stays within what a surface can reflect. Its
+ * three coefficients are fitted to reproduce a colour under the illuminant
+ * for the nodes of a table indexed by the largest channel, its value, and
+ * the other two channels relative to it; coefficients change smoothly with
+ * these, and are interpolated. Values of the largest channel are spaced
+ * more densely towards black and white, where the coefficients grow.
+ */
+#define LUZ_UPSAMPLE_RES        24
+#define LUZ_UPSAMPLE_ITERATIONS 48 /* Gauss-Newton steps per node, at most */
+
+typedef struct _LuzUpsample LuzUpsample;
+
+struct _LuzUpsample
+{
+  float scale[LUZ_UPSAMPLE_RES]; /* largest channel value of each node */
+  float coeffs[3][LUZ_UPSAMPLE_RES][LUZ_UPSAMPLE_RES][LUZ_UPSAMPLE_RES][3];
+                                 /* by largest channel, its value, and the
+                                    next two channels, wrapping, relative
+                                    to it */
+};
+
+/* an illuminant folded into the observer, mapping a reflectance spectrum
+ * directly to XYZ
+ */
+typedef struct _ProofIlluminant ProofIlluminant;
+
+struct _ProofIlluminant
+{
+  float xyz[3][LUZ_SPECTRUM_BANDS];
+  float white_xyz[3];
 };
 
 typedef struct _SpectrumDb SpectrumDb;
@@ -97,51 +399,289 @@ struct _Luz
 
   Spectrum illuminant;
   float    rev_y_scale; /* computed when illuminant are set */
+  float    white_xyz[3]; /* of the illuminant, reference white for Lab */
   Spectrum substrate;
 
   Coat     coat_def[LUZ_MAX_COATS];
   int32_t  coats;
   float    coverage_limit;
-  InkMix   lut[LUT_DIM*LUT_DIM*LUT_DIM];
+  InkMix  *lut;  /* lut_dim^3 cells, kept across reconfiguration */
+  InkMix  *lab_lut; /* lut_dim^3 cells indexed by Lab, created on first use */
+  int32_t  lut_dim;
+  LuzStatsShard *stats; /* LUZ_STATS_SHARDS, kept across reconfiguration */
+  LuzTrace *trace;      /* NULL unless tracing, kept across reconfiguration */
+  LuzMemo  *memo;       /* created on first use, kept across reconfiguration */
+  int32_t   memo_size;  /* entries, memo= from the configuration */
+  LuzSeeds *seeds;      /* created on first use, see luz_get_seeds */
+  int32_t   seeds_state;
+  int32_t   seed_count; /* samples tried per solve, seeds= from the
+                           configuration, 0 for the exhaustive search and
+                           -1 to choose by solver and coat count */
+  int32_t    direct;     /* solve each distinct colour, direct= */
+  int32_t    subsets;    /* search subsets of the coats, subsets=, -1 to
+                            choose by coat count */
+  LuzTable   table;      /* table= */
+  float      refine;     /* CIEDE2000 residual splitting nodes, refine= */
+  int32_t    table_nodes; /* vertices solved at most, table_nodes= */
+  LuzOctree *octree;     /* created on first use, see luz_get_octree */
+  int32_t    octree_state;
+  LuzGamutMap gamut_map; /* gamutmap= */
+  LuzGamut  *gamut;      /* created on first use, see luz_get_gamut */
+  int32_t    gamut_state;
+  LuzHues   *hues;       /* created on first use, see luz_get_hues */
+  int32_t    hues_state;
+  LuzUpsample *upsample; /* created on first use, see luz_get_upsample */
+  int32_t    upsample_state;
+  char      trace_path[256]; /* trace= from the configuration */
   int32_t  debug_width;
   char    *src; /* cached version of the source resulting in a configuration */
 
+  char            proof_illuminant_names[256]; /* proof_illuminants= */
+  ProofIlluminant proof_illuminant[LUZ_MAX_ILLUMINANTS];
+  int32_t         proof_illuminants;
+
 
   Spectrum STANDARD_OBSERVER_X;
   Spectrum STANDARD_OBSERVER_Y;
   Spectrum STANDARD_OBSERVER_Z;
 
+  LuzObjective objective;
+  LuzSolver    solver;
+  int32_t      population;  /* candidates per generation, 4 - LUZ_LANES */
+  int32_t      generations; /* 0 derives them from iterations */
+  ProofIlluminant lit;      /* the illuminant folded into the observer */
+
+  int32_t            black;        /* coat set by black generation,
+                                      black_coat= less one, -1 for none */
+  LuzBlackGeneration black_generation;
+  float              black_amount; /* black at full grey, black_amount= */
+  float              black_start;  /* grey component where black starts,
+                                      black_start= */
+
+  float target_de;     /* difference at which solves stop, target_de=,
+                          delta E or for objective=rgb its proxy, see
+                          objective_close_enough */
+  float build_seconds; /* budget of luz_build_table, build_seconds= */
+
   int   STOCHASTIC_ITERATIONS;
   float STOCHASTIC_DIFFUSION0;
   float STOCHASTIC_DIFFUSION1;
 
 };
 
+static inline LuzStatsShard *
+luz_stats_get_shard (Luz *luz)
+{
+  if (luz_stats_shard < 0)
+    luz_stats_shard = __atomic_fetch_add (&luz_stats_next_shard, 1,
+                                          __ATOMIC_RELAXED) % LUZ_STATS_SHARDS;
+  return &luz->stats[luz_stats_shard];
+}
+
+static inline uint64_t
+luz_trace_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static LuzTraceBuffer *
+luz_trace_get_buffer (LuzTrace *trace)
+{
+  LuzTraceBuffer *buffer;
+
+  if (luz_trace_tls_serial == trace->serial)
+    return luz_trace_tls_buffer;
+
+  if (!luz_trace_tid)
+    luz_trace_tid = __atomic_add_fetch (&luz_trace_next_tid, 1,
+                                        __ATOMIC_RELAXED);
+
+  for (buffer = __atomic_load_n (&trace->buffers, __ATOMIC_ACQUIRE);
+       buffer; buffer = buffer->next)
+    if (buffer->tid == luz_trace_tid)
+      break;
+
+  if (!buffer)
+  {
+    buffer = calloc (sizeof (LuzTraceBuffer), 1);
+    buffer->tid = luz_trace_tid;
+    buffer->next = __atomic_load_n (&trace->buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&trace->buffers, &buffer->next, buffer,
+                                         1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+
+  luz_trace_tls_serial = trace->serial;
+  luz_trace_tls_buffer = buffer;
+  return buffer;
+}
+
+static void
+luz_trace_add (LuzTrace   *trace,
+               const char *name,
+               char        phase,
+               int32_t     arg)
+{
+  LuzTraceBuffer *buffer = luz_trace_get_buffer (trace);
+  LuzTraceEvent  *event;
+
+  if (buffer->count == buffer->capacity)
+  {
+    if (buffer->capacity >= LUZ_TRACE_MAX_EVENTS)
+    {
+      buffer->dropped++;
+      return;
+    }
+    buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+    buffer->events = realloc (buffer->events,
+                              sizeof (LuzTraceEvent) * buffer->capacity);
+  }
+  event = &buffer->events[buffer->count++];
+  event->name = name;
+  event->ts_ns = luz_trace_now ();
+  event->arg = arg;
+  event->phase = phase;
+}
+
+#define LUZ_TRACE_BEGIN(luz, name, arg) \
+  do { if (__builtin_expect ((luz)->trace != NULL, 0)) \
+         luz_trace_add ((luz)->trace, (name), 'B', (arg)); } while (0)
+#define LUZ_TRACE_END(luz, name, arg) \
+  do { if (__builtin_expect ((luz)->trace != NULL, 0)) \
+         luz_trace_add ((luz)->trace, (name), 'E', (arg)); } while (0)
+
+static LuzTrace *
+luz_trace_new (const char *path)
+{
+  LuzTrace *trace = calloc (sizeof (LuzTrace), 1);
+  trace->serial = __atomic_add_fetch (&luz_trace_next_serial, 1,
+                                      __ATOMIC_RELAXED);
+  trace->path = strdup (path);
+  trace->start_ns = luz_trace_now ();
+  return trace;
+}
+
+static void
+luz_trace_write (LuzTrace *trace)
+{
+  FILE *file = fopen (trace->path, "w");
+  LuzTraceBuffer *buffer;
+  const char *sep = "";
+  int pid = getpid ();
+
+  if (!file)
+  {
+    fprintf (stderr, "luz: failed to write trace %s\n", trace->path);
+    return;
+  }
+
+  fprintf (file, "{\"traceEvents\": [\n");
+  for (buffer = trace->buffers; buffer; buffer = buffer->next)
+  {
+    int i;
+    for (i = 0; i < buffer->count; i++)
+    {
+      LuzTraceEvent *event = &buffer->events[i];
+      fprintf (file, "%s{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, "
+                     "\"pid\": %i, \"tid\": %i",
+               sep, event->name, event->phase,
+               (event->ts_ns - trace->start_ns) / 1000.0, pid, buffer->tid);
+      if (event->arg >= 0)
+        fprintf (file, ", \"args\": {\"value\": %i}", event->arg);
+      fprintf (file, "}");
+      sep = ",\n";
+    }
+    if (buffer->dropped)
+      fprintf (stderr, "luz: trace buffer full, %i events of thread %i dropped\n",
+               buffer->dropped, buffer->tid);
+  }
+  fprintf (file, "\n]}\n");
+  fclose (file);
+}
+
+static void
+luz_trace_destroy (LuzTrace *trace)
+{
+  LuzTraceBuffer *buffer = trace->buffers;
+  luz_trace_write (trace);
+  while (buffer)
+  {
+    LuzTraceBuffer *next = buffer->next;
+    free (buffer->events);
+    free (buffer);
+    buffer = next;
+  }
+  free (trace->path);
+  free (trace);
+}
+
+void
+luz_trace_begin (Luz        *luz,
+                 const char *name)
+{
+  LUZ_TRACE_BEGIN (luz, name, -1);
+}
+
+void
+luz_trace_end (Luz        *luz,
+               const char *name)
+{
+  LUZ_TRACE_END (luz, name, -1);
+}
+
 /* need a spectral resampler,..
  *
  */
 
 const Spectrum *luz_get_spectrum (Luz *luz, const char *name);
 
-static inline int lut_indice (float  val, float *delta)
+/* finds the pair of LUT nodes to interpolate between, using only every
+ * stride'th node (and the last one) - coarser strides give a coarser table
+ * that needs fewer cells solved.
+ */
+static inline int lut_indice (int dim, float  val, int stride, int *next, float *delta)
 {
-  /* LUT_DIM-1 to have both 0.0 and 1.0 values to interpolate from */
-  int v = floor (val * (LUT_DIM - 1));
+  /* dim-1 to have both 0.0 and 1.0 values to interpolate from */
+  float pos = val * (dim - 1);
+  int v = floor (pos / stride) * stride;
   if (v < 0)
     v = 0;
-  if (v >= (LUT_DIM-1))
-    v = LUT_DIM - 2;
-  //if (delta)
-     *delta = ((val * (LUT_DIM - 1)) - v);
+  if (v >= (dim-1))
+    v = ((dim - 2) / stride) * stride;
+  *next = v + stride;
+  if (*next > dim - 1)
+    *next = dim - 1;
+  *delta = (pos - v) / (*next - v);
   return v;
 }
 
+/* the table stride and spectral band step used for a GEGL level of detail,
+ * level 0 is full precision.
+ */
+static inline int lut_stride_for_level (int dim, int level)
+{
+  int stride;
+  if (level <= 0)
+    return 1;
+  stride = level >= 4 ? dim - 1 : 1 << level;
+  if (stride > dim - 1)
+    stride = dim - 1;
+  return stride;
+}
+
+static inline int band_step_for_level (int level)
+{
+  return level <= 0 ? 1 : 2;
+}
+
 static inline int
-lut_index (int ri,
+lut_index (int dim,
+           int ri,
            int gi,
            int bi)
 {
-  return ri * LUT_DIM * LUT_DIM + gi * LUT_DIM + bi;
+  return ri * dim * dim + gi * dim + bi;
 }
 
 
@@ -184,12 +724,13 @@ add_coat (Spectrum       *s,
           const Spectrum *on_black,
           const Spectrum *opaqueness,
           float           coverage,
-          float           trc_gamma)
+          float           trc_gamma,
+          int             step)
 {
    int i;
    if (trc_gamma != 1.0)
     coverage = powf (coverage, trc_gamma);
-   for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
+   for (i = 0; i < LUZ_SPECTRUM_BANDS; i += step)
    {
      float band_val = s->bands[i];
      float band_bc;
@@ -214,14 +755,24 @@ this band
    }
 }
 
-static inline float spectrum_integrate (const Spectrum *s,
-                                        const Spectrum *is)
+/* step > 1 integrates only every step'th band, for reduced precision
+ * previews
+ */
+static inline float spectrum_integrate_step (const Spectrum *s,
+                                             const Spectrum *is,
+                                             int             step)
 {
   float result = 0.0;
   int i;
-  for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
+  for (i = 0; i < LUZ_SPECTRUM_BANDS; i += step)
     result += s->bands[i] * is->bands[i];
-  return (result / LUZ_SPECTRUM_BANDS);
+  return (result / ((LUZ_SPECTRUM_BANDS + step - 1) / step));
+}
+
+static inline float spectrum_integrate (const Spectrum *s,
+                                        const Spectrum *is)
+{
+  return spectrum_integrate_step (s, is, 1);
 }
 
 static inline float
@@ -232,22 +783,33 @@ illuminant_to_rev_y_scale (Luz *luz,
 }
 
 static inline void
-spectrum_to_xyz (Luz  *luz,
-                 const Spectrum *observed,
-                 float          *x,
-                 float          *y,
-                 float          *z)
+spectrum_to_xyz_step (Luz  *luz,
+                      const Spectrum *observed,
+                      float          *x,
+                      float          *y,
+                      float          *z,
+                      int             step)
 {
   Spectrum rescaled = *observed;
 
-  *x = spectrum_integrate (&rescaled, &luz->STANDARD_OBSERVER_X) *
+  *x = spectrum_integrate_step (&rescaled, &luz->STANDARD_OBSERVER_X, step) *
          luz->rev_y_scale;
-  *y = spectrum_integrate (&rescaled, &luz->STANDARD_OBSERVER_Y) *
+  *y = spectrum_integrate_step (&rescaled, &luz->STANDARD_OBSERVER_Y, step) *
          luz->rev_y_scale;
-  *z = spectrum_integrate (&rescaled, &luz->STANDARD_OBSERVER_Z) *
+  *z = spectrum_integrate_step (&rescaled, &luz->STANDARD_OBSERVER_Z, step) *
          luz->rev_y_scale;
 }
 
+static inline void
+spectrum_to_xyz (Luz  *luz,
+                 const Spectrum *observed,
+                 float          *x,
+                 float          *y,
+                 float          *z)
+{
+  spectrum_to_xyz_step (luz, observed, x, y, z, 1);
+}
+
 void
 luz_spectrum_to_xyz (Luz  *luz,
                      const Spectrum *observed,
@@ -258,15 +820,10 @@ luz_spectrum_to_xyz (Luz  *luz,
   spectrum_to_xyz (luz, observed, x, y, z);
 }
 
-static const Babl *fish = NULL;
-
 static inline void
-spectrum_to_rgb (Luz            *luz,
-                 const Spectrum *observed,
-                 float          *rgb)
+xyz_to_rgb (const float *xyz,
+            float       *rgb)
 {
-  float xyz[3];
-  spectrum_to_xyz (luz, observed, &xyz[0], &xyz[1], &xyz[2]);
   rgb[0] = xyz[0] * 3.134274799724 +
            xyz[1] * -1.617275708956 +
            xyz[2] * -0.490724283042;
@@ -278,6 +835,25 @@ spectrum_to_rgb (Luz            *luz,
            xyz[2] * 1.405718224383;
 }
 
+static inline void
+spectrum_to_rgb_step (Luz            *luz,
+                      const Spectrum *observed,
+                      float          *rgb,
+                      int             step)
+{
+  float xyz[3];
+  spectrum_to_xyz_step (luz, observed, &xyz[0], &xyz[1], &xyz[2], step);
+  xyz_to_rgb (xyz, rgb);
+}
+
+static inline void
+spectrum_to_rgb (Luz            *luz,
+                 const Spectrum *observed,
+                 float          *rgb)
+{
+  spectrum_to_rgb_step (luz, observed, rgb, 1);
+}
+
 void
 luz_spectrum_to_rgb (Luz            *luz,
                      const Spectrum *observed,
@@ -316,9 +892,11 @@ static void color_recompute (Luz *luz, Coat *coat)
 #endif
 }
 
+/* the reflectance of the substrate with coats applied, before lighting */
 static inline Spectrum
-coats_to_spectrum_continous (Luz  *luz,
-                            const float *coat_levels)
+coats_to_reflectance (Luz         *luz,
+                      const float *coat_levels,
+                      int          step)
 {
   int i;
   Spectrum spec = luz->substrate;
@@ -329,8 +907,17 @@ coats_to_spectrum_continous (Luz  *luz,
                      &luz->coat_def[i].on_black,
                      &luz->coat_def[i].opaqueness,
                      coat_levels[i] * luz->coat_def[i].scale,
-                     luz->coat_def[i].trc_gamma);
+                     luz->coat_def[i].trc_gamma,
+                     step);
+  return spec;
+}
 
+static inline Spectrum
+coats_to_spectrum_continous (Luz  *luz,
+                            const float *coat_levels,
+                            int          step)
+{
+  Spectrum spec = coats_to_reflectance (luz, coat_levels, step);
   spectrum_scale (&spec, &spec, &luz->illuminant);
   return spec;
 }
@@ -339,7 +926,7 @@ static inline Spectrum
 coats_to_spectrum (Luz *luz,
                   const float  *coat_levels)
 {
-  return coats_to_spectrum_continous (luz, coat_levels);
+  return coats_to_spectrum_continous (luz, coat_levels, 1);
 }
 
 void
@@ -351,6 +938,17 @@ luz_coats_to_rgb (Luz *luz,
   spectrum_to_rgb (luz, &perceived_spec, rgb);
 }
 
+void
+luz_coats_to_rgb_level (Luz         *luz,
+                        const float *coat_levels,
+                        float       *rgb,
+                        int          level)
+{
+  int step = band_step_for_level (level);
+  Spectrum perceived_spec = coats_to_spectrum_continous (luz, coat_levels, step);
+  spectrum_to_rgb_step (luz, &perceived_spec, rgb, step);
+}
+
 void
 luz_coats_to_xyz (Luz *luz,
                      const float  *coat_levels,
@@ -373,66 +971,644 @@ colordiff (float *rgb_a,
 }
 
 static inline float
-spec_diff_squared (const float *spec_a,
-                   const float *spec_b,
-                   int    bands)
+lab_f (float t)
 {
-  float sum = 0.0;
-  int i;
-  /* using CIE Lab delta E here, would not improve things, and be a waste of cycles.
-   */
-  for (i = 0; i < bands; i++)
-    {
-      sum += (spec_a[i] - spec_b[i]) *
-             (spec_a[i] - spec_b[i]);
-    }
+  if (t > 0.008856f)
+    return cbrtf (t);
+  return t * 7.787037f + 16.0f / 116.0f;
+}
 
-  return sum;
+static inline void
+xyz_to_lab_white (const float *white_xyz,
+                  const float *xyz,
+                  float       *lab)
+{
+  float fx = lab_f (xyz[0] / white_xyz[0]);
+  float fy = lab_f (xyz[1] / white_xyz[1]);
+  float fz = lab_f (xyz[2] / white_xyz[2]);
+  lab[0] = 116.0f * fy - 16.0f;
+  lab[1] = 500.0f * (fx - fy);
+  lab[2] = 200.0f * (fy - fz);
 }
 
+/* CIE Lab relative to the current illuminant */
 static inline void
-luz_rgb_to_coats_stochastic (Luz *luz,
-                             const float  *rgb,
-                             Spectrum *spectrum, // if passed rgb is ignored
-                             float  *coat_levels,
-                             int     iterations,
-                             float   rrange0,
-                             float   rrange1)
+xyz_to_lab (Luz         *luz,
+            const float *xyz,
+            float       *lab)
 {
-  float prev_best[LUZ_MAX_COATS] = {};
-  float best[LUZ_MAX_COATS] = {};
-  float bestdiff = 1000.0;
-  float attempt[LUZ_MAX_COATS];
-  int i;
+  xyz_to_lab_white (luz->white_xyz, xyz, lab);
+}
 
-  for (i = 0; i < luz->coats; i++)
-    attempt[i] = prev_best[i] = best[i] = coat_levels[i];
+/* CIEDE2000 color difference, following Sharma, Wu and Dalal's notes */
+static inline float
+delta_e2000 (const float *lab1,
+             const float *lab2)
+{
+  const double deg = M_PI / 180.0;
+  double c1 = hypot (lab1[1], lab1[2]);
+  double c2 = hypot (lab2[1], lab2[2]);
+  double c_avg = (c1 + c2) / 2.0;
+  double c_avg7 = pow (c_avg, 7.0);
+  double g = 0.5 * (1.0 - sqrt (c_avg7 / (c_avg7 + 6103515625.0 /* 25^7 */)));
+  double a1 = lab1[1] * (1.0 + g);
+  double a2 = lab2[1] * (1.0 + g);
+  double cp1 = hypot (a1, lab1[2]);
+  double cp2 = hypot (a2, lab2[2]);
+  double hp1 = (a1 == 0.0 && lab1[2] == 0.0) ? 0.0 : atan2 (lab1[2], a1);
+  double hp2 = (a2 == 0.0 && lab2[2] == 0.0) ? 0.0 : atan2 (lab2[2], a2);
+  double dl, dc, dh, dhp;
+  double l_avg, cp_avg, hp_avg, t, sl, sc, sh, rt, l50;
+
+  if (hp1 < 0) hp1 += 2 * M_PI;
+  if (hp2 < 0) hp2 += 2 * M_PI;
+
+  dl = lab2[0] - lab1[0];
+  dc = cp2 - cp1;
+  dhp = hp2 - hp1;
+  if (cp1 * cp2 == 0.0)
+    dhp = 0.0;
+  else if (dhp > M_PI)
+    dhp -= 2 * M_PI;
+  else if (dhp < -M_PI)
+    dhp += 2 * M_PI;
+  dh = 2.0 * sqrt (cp1 * cp2) * sin (dhp / 2.0);
+
+  l_avg = (lab1[0] + lab2[0]) / 2.0;
+  cp_avg = (cp1 + cp2) / 2.0;
+  if (cp1 * cp2 == 0.0)
+    hp_avg = hp1 + hp2;
+  else if (fabs (hp1 - hp2) <= M_PI)
+    hp_avg = (hp1 + hp2) / 2.0;
+  else if (hp1 + hp2 < 2 * M_PI)
+    hp_avg = (hp1 + hp2 + 2 * M_PI) / 2.0;
+  else
+    hp_avg = (hp1 + hp2 - 2 * M_PI) / 2.0;
+
+  t = 1.0 - 0.17 * cos (hp_avg - 30 * deg) + 0.24 * cos (2 * hp_avg) +
+      0.32 * cos (3 * hp_avg + 6 * deg) - 0.20 * cos (4 * hp_avg - 63 * deg);
+  l50 = (l_avg - 50.0) * (l_avg - 50.0);
+  sl = 1.0 + 0.015 * l50 / sqrt (20.0 + l50);
+  sc = 1.0 + 0.045 * cp_avg;
+  sh = 1.0 + 0.015 * cp_avg * t;
+  c_avg7 = pow (cp_avg, 7.0);
+  rt = -2.0 * sqrt (c_avg7 / (c_avg7 + 6103515625.0)) *
+       sin (60 * deg * exp (-pow ((hp_avg / deg - 275.0) / 25.0, 2.0)));
+
+  return sqrt ((dl / sl) * (dl / sl) + (dc / sc) * (dc / sc) +
+               (dh / sh) * (dh / sh) + rt * (dc / sc) * (dh / sh));
+}
 
-  for (i = 0; i < iterations; i++)
-  {
-    int j;
-    int   max_coatsum_attempts = 10000;
-    float softrgb[4];
-    float diff;
-    float coatsum = 0;
-    coatsum = 0.0;
-    for (j = 0; j < luz->coats; j++)
-      {
-        coatsum += attempt[j];
-      }
+/* proofing under several illuminants; the reflectance of the coat stack is
+ * computed once, and each illuminant only costs a 3x31 matrix product.
+ */
 
-    if (spectrum)
-    {
-      Spectrum soft_spect = luz_coats_to_spectrum (luz, attempt);
-      diff = spec_diff_squared (&spectrum->bands[0],
-                                &soft_spect.bands[0],
-                                LUZ_SPECTRUM_BANDS);
-    }
-    else
+static void
+proof_illuminant_init (Luz             *luz,
+                       ProofIlluminant *pi,
+                       const Spectrum  *illuminant)
+{
+  const Spectrum *observer[3] = {&luz->STANDARD_OBSERVER_X,
+                                 &luz->STANDARD_OBSERVER_Y,
+                                 &luz->STANDARD_OBSERVER_Z};
+  float rev_y_scale = illuminant_to_rev_y_scale (luz, illuminant);
+  int c, i;
+  for (c = 0; c < 3; c++)
+  {
+    pi->white_xyz[c] = 0.0f;
+    for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
     {
-      luz_coats_to_rgb (luz, attempt, softrgb);
-      diff = spec_diff_squared (rgb, softrgb, 3);
+      pi->xyz[c][i] = observer[c]->bands[i] * illuminant->bands[i] *
+                      rev_y_scale / LUZ_SPECTRUM_BANDS;
+      pi->white_xyz[c] += pi->xyz[c][i];
     }
+  }
+}
+
+/* resolves the names in proof_illuminants=, defaulting to the illuminant */
+static void
+luz_update_proof_illuminants (Luz *luz)
+{
+  char  names[sizeof (luz->proof_illuminant_names)];
+  char *name;
+  char *save = NULL;
+
+  proof_illuminant_init (luz, &luz->lit, &luz->illuminant);
+  luz->proof_illuminants = 0;
+  strcpy (names, luz->proof_illuminant_names);
+  for (name = strtok_r (names, " ,\t", &save);
+       name && luz->proof_illuminants < LUZ_MAX_ILLUMINANTS;
+       name = strtok_r (NULL, " ,\t", &save))
+  {
+    const Spectrum *spectrum = luz_get_spectrum (luz, name);
+    if (spectrum)
+      proof_illuminant_init (luz,
+                             &luz->proof_illuminant[luz->proof_illuminants++],
+                             spectrum);
+  }
+  if (luz->proof_illuminants == 0)
+    proof_illuminant_init (luz, &luz->proof_illuminant[luz->proof_illuminants++],
+                           &luz->illuminant);
+}
+
+static inline void
+reflectance_to_xyz (const ProofIlluminant *pi,
+                    const Spectrum        *reflectance,
+                    float                 *xyz)
+{
+  int c, i;
+  for (c = 0; c < 3; c++)
+  {
+    float sum = 0.0f;
+    for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
+      sum += pi->xyz[c][i] * reflectance->bands[i];
+    xyz[c] = sum;
+  }
+}
+
+int
+luz_get_proof_illuminant_count (Luz *luz)
+{
+  return luz->proof_illuminants;
+}
+
+void
+luz_coats_to_rgb_multi (Luz         *luz,
+                        const float *coat_levels,
+                        float       *rgb)
+{
+  Spectrum reflectance = coats_to_reflectance (luz, coat_levels, 1);
+  int i;
+  for (i = 0; i < luz->proof_illuminants; i++)
+  {
+    float xyz[3];
+    reflectance_to_xyz (&luz->proof_illuminant[i], &reflectance, xyz);
+    xyz_to_rgb (xyz, &rgb[i * 3]);
+  }
+}
+
+float
+luz_coats_metamerism (Luz         *luz,
+                      const float *coat_levels)
+{
+  Spectrum reflectance = coats_to_reflectance (luz, coat_levels, 1);
+  float xyz[3];
+  float ref_lab[3];
+  float max = 0.0f;
+  int i;
+
+  if (luz->proof_illuminants < 2)
+    return 0.0f;
+  reflectance_to_xyz (&luz->proof_illuminant[0], &reflectance, xyz);
+  xyz_to_lab_white (luz->proof_illuminant[0].white_xyz, xyz, ref_lab);
+  for (i = 1; i < luz->proof_illuminants; i++)
+  {
+    float lab[3];
+    float de;
+    reflectance_to_xyz (&luz->proof_illuminant[i], &reflectance, xyz);
+    xyz_to_lab_white (luz->proof_illuminant[i].white_xyz, xyz, lab);
+    de = delta_e2000 (ref_lab, lab);
+    if (de > max)
+      max = de;
+  }
+  return max;
+}
+
+/* atan2 to within 1e-5 radians, for the hue angle */
+static inline float
+fast_atan2f (float y,
+             float x)
+{
+  float ax = fabsf (x);
+  float ay = fabsf (y);
+  float z = ax > ay ? ay / ax : ax / (ay + 1e-30f);
+  float z2 = z * z;
+  float r = z * (0.99997726f + z2 * (-0.33262347f + z2 * (0.19354346f +
+            z2 * (-0.11643287f + z2 * (0.05265332f + z2 * -0.01172120f)))));
+  if (ay > ax)
+    r = (float) M_PI_2 - r;
+  if (x < 0)
+    r = (float) M_PI - r;
+  return y < 0 ? -r : r;
+}
+
+/* squared CIEDE2000 in single precision for the solver objective; hues are
+ * handled as unit vectors - the hue difference and the multiple angle terms
+ * of T follow from their sum and difference without trigonometry, only the
+ * blue region rotation term needs the mean hue as an angle.
+ */
+static inline float
+delta_e2000_squared_fast (const float *lab1,
+                          const float *lab2)
+{
+  float c1 = sqrtf (lab1[1] * lab1[1] + lab1[2] * lab1[2]);
+  float c2 = sqrtf (lab2[1] * lab2[1] + lab2[2] * lab2[2]);
+  float c_avg = (c1 + c2) * 0.5f;
+  float c_avg2 = c_avg * c_avg;
+  float c_avg7 = c_avg2 * c_avg2 * c_avg2 * c_avg;
+  float g = 0.5f * (1.0f - sqrtf (c_avg7 / (c_avg7 + 6103515625.0f)));
+  float a1 = lab1[1] * (1.0f + g);
+  float a2 = lab2[1] * (1.0f + g);
+  float cp1 = sqrtf (a1 * a1 + lab1[2] * lab1[2]);
+  float cp2 = sqrtf (a2 * a2 + lab2[2] * lab2[2]);
+  float u1[2] = {1.0f, 0.0f};
+  float u2[2] = {1.0f, 0.0f};
+  float m[2], len;
+  float dl, dc, dh = 0.0f;
+  float l_avg, cp_avg, t, sl, sc, sh, rt = 0.0f, l50, cp_avg2, cp_avg7;
+  float c2h, s2h;
+
+  if (cp1 > 0.0f)
+  {
+    u1[0] = a1 / cp1;
+    u1[1] = lab1[2] / cp1;
+  }
+  if (cp2 > 0.0f)
+  {
+    u2[0] = a2 / cp2;
+    u2[1] = lab2[2] / cp2;
+  }
+
+  dl = lab2[0] - lab1[0];
+  dc = cp2 - cp1;
+  if (cp1 > 0.0f && cp2 > 0.0f)
+  { /* 2 sqrt (c1 c2) sin (dh / 2), with |u2 - u1| = 2 |sin (dh / 2)| */
+    float dx = u2[0] - u1[0];
+    float dy = u2[1] - u1[1];
+    dh = sqrtf (cp1 * cp2 * (dx * dx + dy * dy));
+    if (u1[0] * u2[1] - u1[1] * u2[0] < 0.0f)
+      dh = -dh;
+  }
+
+  /* the mean hue bisects the smaller arc between the hues, or is the hue of
+   * the chromatic one of the colours
+   */
+  if (cp1 > 0.0f && cp2 > 0.0f)
+  {
+    m[0] = u1[0] + u2[0];
+    m[1] = u1[1] + u2[1];
+  }
+  else
+  {
+    m[0] = cp1 > 0.0f ? u1[0] : u2[0];
+    m[1] = cp1 > 0.0f ? u1[1] : u2[1];
+  }
+  len = sqrtf (m[0] * m[0] + m[1] * m[1]);
+  if (len > 0.0f)
+  {
+    m[0] /= len;
+    m[1] /= len;
+  }
+  else
+  { /* opposite hues */
+    m[0] = -u1[1];
+    m[1] = u1[0];
+  }
+
+  l_avg = (lab1[0] + lab2[0]) * 0.5f;
+  cp_avg = (cp1 + cp2) * 0.5f;
+
+  c2h = m[0] * m[0] - m[1] * m[1];
+  s2h = 2.0f * m[1] * m[0];
+  t = 1.0f - 0.17f * (m[0] * 0.866025404f + m[1] * 0.5f)   /* cos (h - 30) */
+      + 0.24f * c2h                                        /* cos (2h) */
+      + 0.32f * ((c2h * m[0] - s2h * m[1]) * 0.994521895f - /* cos (3h + 6) */
+                 (s2h * m[0] + c2h * m[1]) * 0.104528463f)
+      - 0.20f * ((c2h * c2h - s2h * s2h) * 0.453990500f +   /* cos (4h - 63) */
+                 (2.0f * s2h * c2h) * 0.891006524f);
+  l50 = (l_avg - 50.0f) * (l_avg - 50.0f);
+  sl = 1.0f + 0.015f * l50 / sqrtf (20.0f + l50);
+  sc = 1.0f + 0.045f * cp_avg;
+  sh = 1.0f + 0.015f * cp_avg * t;
+
+  if (m[1] < 0.0f) /* rt only differs from 0 for hues near 275 degrees */
+  {
+    float h = fast_atan2f (m[1], m[0]) * (float)(180.0 / M_PI) + 360.0f;
+    float x = (h - 275.0f) / 25.0f;
+    if (x * x < 16.0f)
+    {
+      float r = (float)(M_PI / 3.0) * expf (-x * x);
+      float r2 = r * r;
+      cp_avg2 = cp_avg * cp_avg;
+      cp_avg7 = cp_avg2 * cp_avg2 * cp_avg2 * cp_avg;
+      rt = -2.0f * sqrtf (cp_avg7 / (cp_avg7 + 6103515625.0f)) *
+           r * (1.0f - r2 / 6.0f * (1.0f - r2 / 20.0f * (1.0f - r2 / 42.0f)));
+    }
+  }
+
+  dl /= sl;
+  dc /= sc;
+  dh /= sh;
+  return dl * dl + dc * dc + dh * dh + rt * dc * dh;
+}
+
+/* cube root good to float precision for the positive values Lab needs, a
+ * bit level first guess refined by two Halley iterations - a fraction of
+ * the cost of cbrtf
+ */
+static inline float
+fast_cbrtf (float x)
+{
+  union { float f; uint32_t i; } u = {x};
+  float y, y3;
+  u.i = u.i / 3 + 709921077;
+  y = u.f;
+  y3 = y * y * y;
+  y = y * (y3 + 2.0f * x) / (2.0f * y3 + x);
+  y3 = y * y * y;
+  return y * (y3 + 2.0f * x) / (2.0f * y3 + x);
+}
+
+static inline float
+lab_f_fast (float t)
+{
+  if (t > 0.008856f)
+    return fast_cbrtf (t);
+  return t * 7.787037f + 16.0f / 116.0f;
+}
+
+static inline void
+xyz_to_lab_fast (Luz         *luz,
+                 const float *xyz,
+                 float       *lab)
+{
+  float fx = lab_f_fast (xyz[0] / luz->white_xyz[0]);
+  float fy = lab_f_fast (xyz[1] / luz->white_xyz[1]);
+  float fz = lab_f_fast (xyz[2] / luz->white_xyz[2]);
+  lab[0] = 116.0f * fy - 16.0f;
+  lab[1] = 500.0f * (fx - fy);
+  lab[2] = 200.0f * (fy - fz);
+}
+
+static inline void
+rgb_to_xyz (const float *rgb,
+            float       *xyz)
+{
+  xyz[0] = rgb[0] * 0.436035160000 +
+           rgb[1] * 0.385116580000 +
+           rgb[2] * 0.143051150000;
+  xyz[1] = rgb[0] * 0.222488400000 +
+           rgb[1] * 0.716903690000 +
+           rgb[2] * 0.060607910000;
+  xyz[2] = rgb[0] * 0.013916020000 +
+           rgb[1] * 0.097061160000 +
+           rgb[2] * 0.713928220000;
+}
+
+/* the solvers prepare their target once, as linear RGB or Lab depending on
+ * the objective, and compare candidates with objective_diff.
+ */
+static inline void
+objective_target (Luz         *luz,
+                  const float *rgb,
+                  float       *target)
+{
+  if (luz->objective == LUZ_OBJECTIVE_RGB)
+  {
+    target[0] = rgb[0];
+    target[1] = rgb[1];
+    target[2] = rgb[2];
+  }
+  else
+  {
+    float xyz[3];
+    rgb_to_xyz (rgb, xyz);
+    xyz_to_lab_fast (luz, xyz, target);
+  }
+}
+
+/* the coordinates targets are given in, linear RGB or Lab */
+static inline void
+objective_coords (Luz         *luz,
+                  const float *xyz,
+                  float       *coords)
+{
+  if (luz->objective == LUZ_OBJECTIVE_RGB)
+    xyz_to_rgb (xyz, coords);
+  else
+    xyz_to_lab_fast (luz, xyz, coords);
+}
+
+static inline float
+objective_diff_xyz (Luz         *luz,
+                    const float *target,
+                    const float *xyz)
+{
+  float soft[3];
+  objective_coords (luz, xyz, soft);
+  if (luz->objective == LUZ_OBJECTIVE_DE2000)
+    return delta_e2000_squared_fast (target, soft);
+  return (target[0] - soft[0]) * (target[0] - soft[0]) +
+         (target[1] - soft[1]) * (target[1] - soft[1]) +
+         (target[2] - soft[2]) * (target[2] - soft[2]);
+}
+
+static inline float
+objective_diff (Luz         *luz,
+                const float *target,
+                const float *coat_levels)
+{
+  float xyz[3];
+  luz_coats_to_xyz (luz, coat_levels, xyz);
+  return objective_diff_xyz (luz, target, xyz);
+}
+
+/* the difference below which a solve stops early, target_de= delta E for
+ * the perceptual objectives, and for RGB a channel difference of 1/50 of
+ * it - 1% at the default half a delta E
+ */
+static inline float
+objective_close_enough (Luz *luz)
+{
+  float close = luz->objective == LUZ_OBJECTIVE_RGB ? luz->target_de / 50.0f :
+                                                      luz->target_de;
+  return close * close;
+}
+
+/* black generation; with black_coat= that coat is not searched, its level
+ * follows the grey component of the target - the grey its brightest
+ * channel makes, as one less its lightness in L / 100. Grey components
+ * from black_start= up are stretched to span white to black, and the coat
+ * gets the level with which it alone has the stretched lightness, scaled
+ * by black_amount=; with black_generation=ucr it also fades out with the
+ * chroma of the target, gone at LUZ_BLACK_UCR_CHROMA.
+ */
+#define LUZ_BLACK_UCR_CHROMA 30.0f
+
+static inline int luz_discrete (Luz *luz);
+
+static inline int
+luz_black_coat (Luz            *luz,
+                const Spectrum *spectrum)
+{
+  if (spectrum || luz->black < 0 || luz->black >= luz->coats ||
+      luz->coats < 2 || luz_discrete (luz))
+    return -1;
+  return luz->black;
+}
+
+static inline float
+black_generation (Luz         *luz,
+                  const float *rgb)
+{
+  float brightest = CLAMP (MAX (rgb[0], MAX (rgb[1], rgb[2])), 0.0f, 1.0f);
+  float grey = 1.0f - (116.0f * lab_f (brightest) - 16.0f) / 100.0f;
+  float t = (grey - luz->black_start) / MAX (1.0f - luz->black_start, 0.0001f);
+  float lightness = 100.0f * (1.0f - CLAMP (t, 0.0f, 1.0f));
+  float lo = 0.0f, hi = 1.0f;
+  float xyz[3];
+  float black;
+  int i;
+
+  if (t <= 0.0f)
+    return 0.0f;
+  for (i = 0; i < 12; i++) /* the ramp of the coat alone darkens */
+  {
+    float levels[LUZ_MAX_COATS] = {0.0f,};
+    levels[luz->black] = (lo + hi) / 2;
+    luz_coats_to_xyz (luz, levels, xyz);
+    if (116.0f * lab_f (xyz[1] / luz->white_xyz[1]) - 16.0f > lightness)
+      lo = levels[luz->black];
+    else
+      hi = levels[luz->black];
+  }
+  black = luz->black_amount * (lo + hi) / 2;
+  if (luz->black_generation == LUZ_BLACK_UCR)
+  {
+    float lab[3];
+    rgb_to_xyz (rgb, xyz);
+    xyz_to_lab (luz, xyz, lab);
+    black *= CLAMP (1.0f - sqrtf (lab[1] * lab[1] + lab[2] * lab[2]) /
+                           LUZ_BLACK_UCR_CHROMA, 0.0f, 1.0f);
+  }
+  return CLAMP (black, 0.0f, MIN (1.0f, luz->coverage_limit));
+}
+
+/* the coats a solve searches, a bit per coat; the solvers leave the others
+ * at the levels they are given */
+#define COAT_ACTIVE(active, c) (((active) >> (c)) & 1)
+
+static inline uint32_t
+luz_active_coats (Luz            *luz,
+                  const Spectrum *spectrum)
+{
+  uint32_t active = (1u << luz->coats) - 1;
+  int      black = luz_black_coat (luz, spectrum);
+  if (black >= 0)
+    active &= ~(1u << black);
+  return active;
+}
+
+/* clamps coat levels to 0.0 - 1.0 and scales the active ones within the
+ * coverage limit */
+static inline void
+coats_constrain (Luz      *luz,
+                 float    *coat_levels,
+                 uint32_t  active)
+{
+  float coatsum = 0.0f;
+  float held = 0.0f;
+  int c;
+  for (c = 0; c < luz->coats; c++)
+  {
+    coat_levels[c] = CLAMP (coat_levels[c], 0.0f, 1.0f);
+    coatsum += coat_levels[c];
+    if (!COAT_ACTIVE (active, c))
+      held += coat_levels[c];
+  }
+  if (coatsum <= luz->coverage_limit)
+    return;
+  for (c = 0; c < luz->coats; c++)
+    if (COAT_ACTIVE (active, c))
+      coat_levels[c] *= MAX (luz->coverage_limit - held, 0.0f) /
+                        MAX (coatsum - held, 0.0001f);
+}
+
+static inline float
+spec_diff_squared (const float *spec_a,
+                   const float *spec_b,
+                   int    bands)
+{
+  float sum = 0.0;
+  int i;
+  /* using CIE Lab delta E here, would not improve things, and be a waste of cycles.
+   */
+  for (i = 0; i < bands; i++)
+    {
+      sum += (spec_a[i] - spec_b[i]) *
+             (spec_a[i] - spec_b[i]);
+    }
+
+  return sum;
+}
+
+/* xorshift32, the solvers carry their own state rather than using the
+ * shared random() - keeping them reentrant and their results reproducible
+ * regardless of which thread solves a cell.
+ */
+static inline uint32_t
+luz_random (uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static inline uint32_t
+luz_random_seed (uint32_t key)
+{
+  return (key + 1) * 2654435761u | 1;
+}
+
+static inline void
+luz_rgb_to_coats_stochastic (Luz *luz,
+                             const float  *rgb,
+                             Spectrum *spectrum, // if passed rgb is ignored
+                             float  *coat_levels,
+                             uint32_t *rng,
+                             uint32_t active,
+                             int     iterations,
+                             float   rrange0,
+                             float   rrange1)
+{
+  float prev_best[LUZ_MAX_COATS] = {};
+  float best[LUZ_MAX_COATS] = {};
+  float bestdiff = 1e30f;
+  float attempt[LUZ_MAX_COATS];
+  float target[3];
+  float close_enough = spectrum ? 0.0001f : objective_close_enough (luz);
+  uint64_t rejected = 0;
+  int early_exit = 0;
+  int i;
+
+  if (!spectrum)
+    objective_target (luz, rgb, target);
+  for (i = 0; i < luz->coats; i++)
+    attempt[i] = prev_best[i] = best[i] = coat_levels[i];
+
+  for (i = 0; i < iterations; i++)
+  {
+    int j;
+    int   max_coatsum_attempts = 10000;
+    float diff;
+    float coatsum = 0;
+    coatsum = 0.0;
+    for (j = 0; j < luz->coats; j++)
+      {
+        coatsum += attempt[j];
+      }
+
+    if (spectrum)
+    {
+      Spectrum soft_spect = luz_coats_to_spectrum (luz, attempt);
+      diff = spec_diff_squared (&spectrum->bands[0],
+                                &soft_spect.bands[0],
+                                LUZ_SPECTRUM_BANDS);
+    }
+    else
+      diff = objective_diff (luz, target, attempt);
     if (diff < bestdiff)
     {
       bestdiff = diff;
@@ -441,8 +1617,11 @@ luz_rgb_to_coats_stochastic (Luz *luz,
         prev_best[j] = best[j];
         best[j] = attempt[j];
       }
-      if (diff < 0.0001) /* close enough */
+      if (diff < close_enough)
+      {
+        early_exit = 1;
         break;
+      }
     }
 
 
@@ -452,6 +1631,13 @@ luz_rgb_to_coats_stochastic (Luz *luz,
       {
         float dir = prev_best[j] - best[j];
 
+        if (!COAT_ACTIVE (active, j))
+        {
+          attempt[j] = best[j];
+          coatsum += attempt[j];
+          continue;
+        }
+
         if (dir > 0.001)
           dir = 0.75;
         else if (dir < -0.001)
@@ -459,15 +1645,23 @@ luz_rgb_to_coats_stochastic (Luz *luz,
         else
           dir = 1.0;
 
-        attempt[j] = best[j] + ((random()%10000)/5000.0-dir) *
+        attempt[j] = best[j] + ((luz_random (rng)%10000)/5000.0-dir) *
             ((i * rrange1 / iterations) +
              ((iterations-i) * ( rrange0 / iterations)));
         attempt[j] = CLAMP(attempt[j],0,1);
         coatsum += attempt[j];
       }
+      rejected++;
     } while (coatsum > luz->coverage_limit && (--max_coatsum_attempts > 0));
+    if (coatsum <= luz->coverage_limit)
+      rejected--; /* the accepted draw, when attempts did not run out */
   }
 
+  LUZ_STAT_ADD (luz, stochastic_evaluations, i + (i < iterations));
+  LUZ_STAT_ADD (luz, rejected_draws, rejected);
+  if (early_exit)
+    LUZ_STAT_ADD (luz, early_exits, 1);
+
   for (i = 0; i < luz->coats; i++)
     coat_levels[i] = best[i];
 }
@@ -476,197 +1670,2822 @@ static inline void
 luz_rgb_to_coats_griddy (Luz   *luz,
                          const float *rgb,
                          Spectrum *spectrum, // if passed rgb is ignored
-                         float *coat_levels)
+                         float *coat_levels,
+                         uint32_t active)
 {
   float prev_best[LUZ_MAX_COATS] = {};
   float best[LUZ_MAX_COATS] = {};
-  float bestdiff = 1000.0;
+  float bestdiff = 1e30f;
   float attempt[LUZ_MAX_COATS]={0.,};
-  int i;
+  float target[3];
+  float close_enough = spectrum ? 0.0001f : objective_close_enough (luz);
+  uint64_t evaluations = 0;
+  int early_exit = 0;
+  int i, j;
 
+  if (!spectrum)
+    objective_target (luz, rgb, target);
   for (i = 0; i < luz->coats; i++)
+  {
     prev_best[i] = best[i] = coat_levels[i];
+    if (!COAT_ACTIVE (active, i))
+      attempt[i] = coat_levels[i];
+  }
+
+  do
+  {
+    float diff;
+    float coatsum = 0;
+
+
+    coatsum = 0.0;
+    for (j = 0; j < luz->coats; j++)
+    {
+      coatsum += attempt[j];
+    }
+
+    if (coatsum <= luz->coverage_limit)
+    {
+      evaluations++;
+      if (spectrum)
+      {
+        Spectrum soft_spec = luz_coats_to_spectrum (luz, attempt);
+        diff = spec_diff_squared (&spectrum->bands[0],
+                                  &soft_spec.bands[0],
+                                  LUZ_SPECTRUM_BANDS);
+      }
+      else
+        diff = objective_diff (luz, target, attempt);
+
+    if (diff < bestdiff)
+    {
+      bestdiff = diff;
+      for (j = 0; j < luz->coats; j++)
+      {
+        prev_best[j] = best[j];
+        best[j] = attempt[j];
+      }
+      if (diff < close_enough)
+      {
+        early_exit = 1;
+        break;
+      }
+    }
+    }
+
+    /* update exhaustive attempts, carrying into the coat before when one
+       passes 1.0, inactive coats are not stepped */
+    for (j = luz->coats - 1; j >= 0; j--)
+    {
+      if (!COAT_ACTIVE (active, j))
+        continue;
+      attempt[j] += INCREMENT;
+      if (attempt[j] <= 1.0)
+        break;
+      attempt[j] = 0;
+    }
+
+  } while (j >= 0);
+
+  LUZ_STAT_ADD (luz, griddy_evaluations, evaluations);
+  if (early_exit)
+    LUZ_STAT_ADD (luz, early_exits, 1);
+
+  for (i = 0; i < luz->coats; i++)
+    coat_levels[i] = best[i];
+}
+
+/* the forward model for LUZ_LANES candidates at a time, with the candidates
+ * as the innermost dimension so the per band work vectorizes; levels are
+ * stored [coat][lane], xyz [component][lane].
+ */
+#define LUZ_LANES 16
+
+static inline void
+coats_to_xyz_lanes (Luz   *luz,
+                    float  levels[LUZ_MAX_COATS][LUZ_LANES],
+                    float  xyz[3][LUZ_LANES])
+{
+  float spec[LUZ_SPECTRUM_BANDS][LUZ_LANES];
+  int   c, i, l;
+
+  for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
+    for (l = 0; l < LUZ_LANES; l++)
+      spec[i][l] = luz->substrate.bands[i];
+
+  for (c = 0; c < luz->coats; c++)
+  {
+    const Coat *coat = &luz->coat_def[c];
+    float coverage[LUZ_LANES];
+    for (l = 0; l < LUZ_LANES; l++)
+    {
+      coverage[l] = levels[c][l] * coat->scale;
+      if (coat->trc_gamma != 1.0)
+        coverage[l] = powf (coverage[l], coat->trc_gamma);
+    }
+    for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
+    {
+      float on_white = coat->on_white.bands[i];
+      float opacity = coat->opaqueness.bands[i];
+      for (l = 0; l < LUZ_LANES; l++)
+      { /* add_coat () */
+        float band_val = spec[i][l];
+        float band_bc = LERP (band_val, on_white * band_val, coverage[l]);
+        float band_wc = LERP (band_val, on_white, coverage[l]);
+        spec[i][l] = LERP (band_bc, band_wc, opacity);
+      }
+    }
+  }
+
+  for (c = 0; c < 3; c++)
+  {
+    for (l = 0; l < LUZ_LANES; l++)
+      xyz[c][l] = 0.0f;
+    for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
+    {
+      float weight = luz->lit.xyz[c][i];
+      for (l = 0; l < LUZ_LANES; l++)
+        xyz[c][l] += spec[i][l] * weight;
+    }
+  }
+}
+
+static inline float
+luz_random_unit (uint32_t *rng)
+{
+  return (luz_random (rng) & 0xffffff) / 16777216.0f;
+}
+
+/* keeps a candidate within the coat range and the coverage limit */
+static inline void
+population_constrain (Luz      *luz,
+                      float     levels[LUZ_MAX_COATS][LUZ_LANES],
+                      int       lane,
+                      uint32_t  active)
+{
+  float coat_levels[LUZ_MAX_COATS];
+  int c;
+  for (c = 0; c < luz->coats; c++)
+    coat_levels[c] = levels[c][lane];
+  coats_constrain (luz, coat_levels, active);
+  for (c = 0; c < luz->coats; c++)
+    levels[c][lane] = coat_levels[c];
+}
+
+static inline void
+population_evaluate (Luz         *luz,
+                     const float *target,
+                     float        levels[LUZ_MAX_COATS][LUZ_LANES],
+                     int          population,
+                     float       *diff)
+{
+  float xyz[3][LUZ_LANES];
+  int l;
+  coats_to_xyz_lanes (luz, levels, xyz);
+  for (l = 0; l < population; l++)
+  {
+    float lane_xyz[3] = {xyz[0][l], xyz[1][l], xyz[2][l]};
+    diff[l] = objective_diff_xyz (luz, target, lane_xyz);
+  }
+}
+
+/* runs func over count items on the online cores, the calling thread
+ * included; threads take grain items at a time until all are done.
+ */
+typedef void (*LuzParallelFunc) (Luz  *luz,
+                                 void *data,
+                                 int   start,
+                                 int   end);
+
+typedef struct _LuzParallel LuzParallel;
+
+struct _LuzParallel
+{
+  Luz            *luz;
+  LuzParallelFunc func;
+  void           *data;
+  int             count;
+  int             grain;
+  int32_t         next;
+};
+
+static void *
+luz_parallel_worker (void *data)
+{
+  LuzParallel *p = data;
+  int start;
+  while ((start = __atomic_fetch_add (&p->next, p->grain, __ATOMIC_RELAXED)) <
+         p->count)
+    p->func (p->luz, p->data, start, MIN (start + p->grain, p->count));
+  return NULL;
+}
+
+static void
+luz_parallel_for (Luz            *luz,
+                  int             count,
+                  int             grain,
+                  LuzParallelFunc func,
+                  void           *data)
+{
+  LuzParallel p = {luz, func, data, count, MAX (grain, 1), 0};
+  pthread_t   thread[16];
+  int         threads = CLAMP ((int) sysconf (_SC_NPROCESSORS_ONLN), 1, 16);
+  int         started = 0;
+  int         i;
+
+  threads = MIN (threads, (count + p.grain - 1) / p.grain);
+  for (i = 1; i < threads; i++)
+    if (!pthread_create (&thread[started], NULL, luz_parallel_worker, &p))
+      started++;
+  luz_parallel_worker (&p);
+  for (i = 0; i < started; i++)
+    pthread_join (thread[i], NULL);
+}
+
+/* forward samples for seeding solves, see LuzSeeds */
+
+typedef struct _SeedsBuild SeedsBuild;
+
+struct _SeedsBuild
+{
+  int      steps[LUZ_MAX_COATS]; /* lattice levels per coat */
+  float   *coords; /* indexed by lattice index */
+  float   *level;
+  uint8_t *valid;  /* within the coverage limit */
+};
+
+static void
+seeds_evaluate (Luz  *luz,
+                void *data,
+                int   start,
+                int   end)
+{
+  SeedsBuild *w = data;
+  int coats = luz->coats;
+  int index;
+
+  for (index = start; index < end; index += LUZ_LANES)
+  {
+    float levels[LUZ_MAX_COATS][LUZ_LANES] = {{0.0f,},};
+    float xyz[3][LUZ_LANES];
+    int lanes = MIN (LUZ_LANES, end - index);
+    int l, c;
+
+    for (l = 0; l < lanes; l++)
+    {
+      int rest = index + l;
+      float coatsum = 0.0f;
+      for (c = coats - 1; c >= 0; c--)
+      {
+        levels[c][l] = (float)(rest % w->steps[c]) / (w->steps[c] - 1);
+        coatsum += levels[c][l];
+        rest /= w->steps[c];
+      }
+      w->valid[index + l] = coatsum <= luz->coverage_limit + 0.0001f;
+    }
+    coats_to_xyz_lanes (luz, levels, xyz);
+    for (l = 0; l < lanes; l++)
+    {
+      float lane_xyz[3] = {xyz[0][l], xyz[1][l], xyz[2][l]};
+      objective_coords (luz, lane_xyz, &w->coords[(index + l) * 3]);
+      for (c = 0; c < coats; c++)
+        w->level[(index + l) * coats + c] = levels[c][l];
+    }
+  }
+}
+
+/* partially sorts order[lo..hi) on an axis, leaving the median at nth */
+static void
+seeds_select (int         *order,
+              const float *coords,
+              int          axis,
+              int          lo,
+              int          hi,
+              int          nth)
+{
+  hi--;
+  while (lo < hi)
+  {
+    float pivot = coords[order[(lo + hi) / 2] * 3 + axis];
+    int i = lo, j = hi;
+    while (i <= j)
+    {
+      while (coords[order[i] * 3 + axis] < pivot) i++;
+      while (coords[order[j] * 3 + axis] > pivot) j--;
+      if (i <= j)
+      {
+        int tmp = order[i];
+        order[i++] = order[j];
+        order[j--] = tmp;
+      }
+    }
+    if (nth <= j)
+      hi = j;
+    else if (nth >= i)
+      lo = i;
+    else
+      break;
+  }
+}
+
+static void
+seeds_build_tree (int         *order,
+                  const float *coords,
+                  int          lo,
+                  int          hi,
+                  int          depth)
+{
+  int mid = (lo + hi) / 2;
+  if (hi - lo < 2)
+    return;
+  seeds_select (order, coords, depth % 3, lo, hi, mid);
+  seeds_build_tree (order, coords, lo, mid, depth + 1);
+  seeds_build_tree (order, coords, mid + 1, hi, depth + 1);
+}
+
+static void
+luz_seeds_destroy (LuzSeeds *seeds)
+{
+  if (!seeds)
+    return;
+  free (seeds->coords);
+  free (seeds->level);
+  free (seeds);
+}
+
+static size_t
+luz_seeds_memory_usage (LuzSeeds *seeds)
+{
+  return sizeof (LuzSeeds) +
+         (size_t) seeds->count * (3 + seeds->coats) * sizeof (float);
+}
+
+/* the lattice steps of each coat; coats with discrete levels= get exactly
+ * those while their combinations fit, the continuous ones share what is
+ * left of LUZ_SEEDS_MAX. Returns the number of samples.
+ */
+static int
+seeds_steps (Luz *luz,
+             int *steps)
+{
+  int    lattice = (int)(1.0 / INCREMENT + 0.5) + 1;
+  double discrete = 1.0;
+  int    continuous = 0;
+  int    total = 1;
+  int    c;
+
+  for (c = 0; c < luz->coats; c++)
+    if (luz->coat_def[c].levels > 1)
+      discrete *= luz->coat_def[c].levels;
+    else
+      continuous++;
+  if (discrete * pow (2, continuous) > LUZ_SEEDS_MAX)
+  {
+    discrete = 1.0;
+    continuous = luz->coats;
+  }
+  while (lattice > 2 && discrete * pow (lattice, continuous) > LUZ_SEEDS_MAX)
+    lattice--;
+
+  for (c = 0; c < luz->coats; c++)
+  {
+    steps[c] = luz->coat_def[c].levels > 1 && continuous < luz->coats ?
+               luz->coat_def[c].levels : lattice;
+    total *= steps[c];
+  }
+  return total;
+}
+
+/* evaluates the lattice, split over the online cores, and indexes the
+ * samples within the coverage limit */
+static LuzSeeds *
+luz_seeds_new (Luz *luz)
+{
+  LuzSeeds    *seeds = calloc (sizeof (LuzSeeds), 1);
+  SeedsBuild   build;
+  int          coats = luz->coats;
+  int          total;
+  int         *order;
+  float       *coords;
+  float       *level;
+  uint8_t     *valid;
+  int          i;
+
+  total = seeds_steps (luz, build.steps);
+  coords = malloc (sizeof (float) * 3 * total);
+  level  = malloc (sizeof (float) * MAX (coats, 1) * total);
+  valid  = malloc (total);
+  build.coords = coords;
+  build.level = level;
+  build.valid = valid;
+  luz_parallel_for (luz, total, 64 * LUZ_LANES, seeds_evaluate, &build);
+
+  order = malloc (sizeof (int) * total);
+  for (i = 0; i < total; i++)
+    if (valid[i])
+      order[seeds->count++] = i;
+  seeds_build_tree (order, coords, 0, seeds->count, 0);
+
+  seeds->coats  = coats;
+  seeds->coords = malloc (sizeof (float) * 3 * MAX (seeds->count, 1));
+  seeds->level  = malloc (sizeof (float) * MAX (coats, 1) * MAX (seeds->count, 1));
+  for (i = 0; i < seeds->count; i++)
+  {
+    memcpy (&seeds->coords[i * 3], &coords[order[i] * 3], sizeof (float) * 3);
+    memcpy (&seeds->level[i * coats], &level[order[i] * coats],
+            sizeof (float) * coats);
+  }
+  free (order);
+  free (valid);
+  free (level);
+  free (coords);
+  return seeds;
+}
+
+/* the seeds are built by the first thread needing them, others wait */
+static LuzSeeds *
+luz_get_seeds (Luz *luz)
+{
+  int32_t state = __atomic_load_n (&luz->seeds_state, __ATOMIC_ACQUIRE);
+  if (state == LUZ_BUILD_READY)
+    return luz->seeds;
+  if (state == LUZ_BUILD_NONE &&
+      __atomic_compare_exchange_n (&luz->seeds_state, &state,
+                                   LUZ_BUILD_BUSY, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+  {
+    LUZ_TRACE_BEGIN (luz, "build seeds", -1);
+    luz->seeds = luz_seeds_new (luz);
+    LUZ_STAT_ADD (luz, bytes_allocated, luz_seeds_memory_usage (luz->seeds));
+    LUZ_TRACE_END (luz, "build seeds", -1);
+    __atomic_store_n (&luz->seeds_state, LUZ_BUILD_READY, __ATOMIC_RELEASE);
+    return luz->seeds;
+  }
+  LUZ_TRACE_BEGIN (luz, "wait seeds", -1);
+  while (__atomic_load_n (&luz->seeds_state, __ATOMIC_ACQUIRE) != LUZ_BUILD_READY)
+    usleep (100);
+  LUZ_TRACE_END (luz, "wait seeds", -1);
+  return luz->seeds;
+}
+
+static void
+luz_invalidate_seeds (Luz *luz)
+{
+  if (luz->seeds)
+    LUZ_STAT_ADD (luz, bytes_allocated, -luz_seeds_memory_usage (luz->seeds));
+  luz_seeds_destroy (luz->seeds);
+  luz->seeds = NULL;
+  luz->seeds_state = LUZ_BUILD_NONE;
+}
+
+/* the k samples nearest to point, closest first */
+static void
+seeds_nearest (const LuzSeeds *seeds,
+               const float    *point,
+               int             lo,
+               int             hi,
+               int             depth,
+               int             k,
+               int            *found,
+               float          *dist,
+               int            *count)
+{
+  const float *node;
+  float d, delta;
+  int mid, axis, i;
+
+  if (lo >= hi)
+    return;
+  mid = (lo + hi) / 2;
+  axis = depth % 3;
+  node = &seeds->coords[mid * 3];
+  d = (point[0] - node[0]) * (point[0] - node[0]) +
+      (point[1] - node[1]) * (point[1] - node[1]) +
+      (point[2] - node[2]) * (point[2] - node[2]);
+
+  if (*count < k || d < dist[*count - 1])
+  {
+    i = *count < k ? (*count)++ : k - 1;
+    for (; i > 0 && dist[i - 1] > d; i--)
+    {
+      dist[i] = dist[i - 1];
+      found[i] = found[i - 1];
+    }
+    dist[i] = d;
+    found[i] = mid;
+  }
+
+  delta = point[axis] - node[axis];
+  if (delta < 0.0f)
+    seeds_nearest (seeds, point, lo, mid, depth + 1, k, found, dist, count);
+  else
+    seeds_nearest (seeds, point, mid + 1, hi, depth + 1, k, found, dist, count);
+  if (*count < k || delta * delta < dist[*count - 1])
+  {
+    if (delta < 0.0f)
+      seeds_nearest (seeds, point, mid + 1, hi, depth + 1, k, found, dist, count);
+    else
+      seeds_nearest (seeds, point, lo, mid, depth + 1, k, found, dist, count);
+  }
+}
+
+/* writes up to k sets of coat levels nearest to the target, returns how many */
+static int
+luz_seeds_lookup (Luz         *luz,
+                  const float *target,
+                  int          k,
+                  float       *levels)
+{
+  LuzSeeds *seeds = luz_get_seeds (luz);
+  int   found[LUZ_SEEDS_K_MAX];
+  float dist[LUZ_SEEDS_K_MAX];
+  int   count = 0;
+  int   i;
+
+  k = MIN (k, LUZ_SEEDS_K_MAX);
+  seeds_nearest (seeds, target, 0, seeds->count, 0, k, found, dist, &count);
+  for (i = 0; i < count; i++)
+    memcpy (&levels[i * LUZ_MAX_COATS], &seeds->level[found[i] * seeds->coats],
+            sizeof (float) * seeds->coats);
+  LUZ_STAT_ADD (luz, seed_lookups, 1);
+  return count;
+}
+
+/* with seeds=auto the population is seeded when it searches all coats,
+ * the walk keeps the exhaustive search while it is affordable; it found
+ * better behaved dark shadows for 4 coats.
+ */
+static inline int
+luz_seed_count (Luz      *luz,
+                uint32_t  active)
+{
+  if (luz->seed_count >= 0)
+    return luz->seed_count;
+  if ((luz->solver == LUZ_SOLVER_POPULATION &&
+       active == luz_active_coats (luz, NULL)) ||
+      __builtin_popcount (active) >= LUZ_SEEDS_COATS)
+    return LUZ_SEEDS_DEFAULT;
+  return 0;
+}
+
+/* whether every coat has discrete levels=, with few enough combinations
+ * for the seeds to hold them all; solves then pick the best of the nearest
+ * primaries - exact for the Euclidean objectives - and do not search.
+ */
+static inline int
+luz_discrete (Luz *luz)
+{
+  double primaries = 1.0;
+  int c;
+  for (c = 0; c < luz->coats; c++)
+  {
+    if (luz->coat_def[c].levels < 2)
+      return 0;
+    primaries *= luz->coat_def[c].levels;
+  }
+  return luz->coats > 0 && primaries <= LUZ_SEEDS_MAX;
+}
+
+/* primaries compared with the objective, CIEDE2000 is not the distance
+ * the seeds are indexed by */
+static inline int
+luz_primaries_k (Luz *luz)
+{
+  return luz->objective == LUZ_OBJECTIVE_DE2000 ? LUZ_SEEDS_K_MAX : 1;
+}
+
+static inline int
+seeds_lattice_before (const float *a,
+                      const float *b,
+                      int          coats)
+{
+  int c;
+  for (c = 0; c < coats; c++)
+    if (a[c] != b[c])
+      return a[c] < b[c];
+  return 0;
+}
+
+/* replaces the exhaustive search, starting from the best of the nearest
+ * forward samples. Of those close enough the one first in the lattice is
+ * kept, as the exhaustive search would, which keeps neighbouring cells in
+ * the same family of solutions and the table smooth.
+ */
+static inline void
+luz_rgb_to_coats_seeded (Luz         *luz,
+                         const float *rgb,
+                         float       *coat_levels,
+                         uint32_t     active,
+                         int          k)
+{
+  float levels[LUZ_SEEDS_K_MAX][LUZ_MAX_COATS] = {{0.0f,},};
+  float target[3];
+  float close_enough = objective_close_enough (luz);
+  float bestdiff = 1e30f;
+  int   best = -1;
+  int   count, i;
+
+  objective_target (luz, rgb, target);
+  count = luz_seeds_lookup (luz, target, k, &levels[0][0]);
+  for (i = 0; i < count; i++)
+  {
+    float diff;
+    if (active != (1u << luz->coats) - 1)
+    {
+      int c;
+      for (c = 0; c < luz->coats; c++)
+        if (!COAT_ACTIVE (active, c))
+          levels[i][c] = coat_levels[c];
+      coats_constrain (luz, levels[i], active);
+    }
+    diff = objective_diff (luz, target, levels[i]);
+    if (best >= 0 && bestdiff < close_enough)
+    {
+      if (diff < close_enough &&
+          seeds_lattice_before (levels[i], levels[best], luz->coats))
+        best = i;
+    }
+    else if (diff < bestdiff)
+    {
+      bestdiff = diff;
+      best = i;
+    }
+  }
+  if (best >= 0)
+    memcpy (coat_levels, levels[best], sizeof (float) * luz->coats);
+  LUZ_STAT_ADD (luz, griddy_evaluations, count);
+}
+
+/* differential evolution, current-to-best/1 with binomial crossover; the
+ * whole population is evaluated in one call of the lane batched forward
+ * model per generation. coat_levels is the first member of the initial
+ * population, the others are drawn at random.
+ */
+static inline void
+luz_rgb_to_coats_population (Luz         *luz,
+                             const float *rgb,
+                             float       *coat_levels,
+                             uint32_t    *rng,
+                             uint32_t     active,
+                             int          population,
+                             int          generations)
+{
+  float members[LUZ_MAX_COATS][LUZ_LANES] = {{0.0f,},};
+  float trials[LUZ_MAX_COATS][LUZ_LANES] = {{0.0f,},};
+  float member_diff[LUZ_LANES];
+  float trial_diff[LUZ_LANES];
+  float seed[LUZ_SEEDS_K_MAX][LUZ_MAX_COATS];
+  float target[3];
+  float close_enough = objective_close_enough (luz);
+  const float cr = 0.9f;
+  float f;
+  int seeds = 0;
+  int best = 0;
+  int g, l, c;
+
+  if (luz->coats <= 0)
+    return; /* nothing to search, nor a coat to force crossover in */
+
+  objective_target (luz, rgb, target);
+  if (luz->objective == LUZ_OBJECTIVE_RGB)
+  { /* with absolute rgb differences any dark member would end the search
+       for a dark target at once, make the threshold relative */
+    float level = MIN (1.0f, (target[0] + target[1] + target[2]) / 3.0f);
+    close_enough *= MAX (level * level, 0.0001f);
+  }
+
+  if (luz_seed_count (luz, active) > 0)
+    seeds = luz_seeds_lookup (luz, target,
+                              MIN (luz_seed_count (luz, active), population - 1),
+                              &seed[0][0]);
+
+  for (l = 0; l < population; l++)
+  {
+    for (c = 0; c < luz->coats; c++)
+      members[c][l] = l == 0 || !COAT_ACTIVE (active, c) ? coat_levels[c] :
+                      l <= seeds ? seed[l - 1][c] : luz_random_unit (rng);
+    population_constrain (luz, members, l, active);
+  }
+  population_evaluate (luz, target, members, population, member_diff);
+  for (l = 1; l < population; l++)
+    if (member_diff[l] < member_diff[best])
+      best = l;
+
+  for (g = 0; g < generations && member_diff[best] >= close_enough; g++)
+  {
+    /* a step size dithered per generation keeps small populations from
+       collapsing early */
+    f = 0.5f + 0.5f * luz_random_unit (rng);
+    for (l = 0; l < population; l++)
+    {
+      int r1, r2;
+      int forced = luz_random (rng) % luz->coats;
+      do r1 = luz_random (rng) % population; while (r1 == l);
+      do r2 = luz_random (rng) % population; while (r2 == l || r2 == r1);
+
+      for (c = 0; c < luz->coats; c++)
+      {
+        if (c == forced || luz_random_unit (rng) < cr)
+          trials[c][l] = members[c][l] +
+                         f * (members[c][best] - members[c][l]) +
+                         f * (members[c][r1] - members[c][r2]);
+        else
+          trials[c][l] = members[c][l];
+      }
+      population_constrain (luz, trials, l, active);
+    }
+    population_evaluate (luz, target, trials, population, trial_diff);
+
+    for (l = 0; l < population; l++)
+      if (trial_diff[l] <= member_diff[l])
+      {
+        for (c = 0; c < luz->coats; c++)
+          members[c][l] = trials[c][l];
+        member_diff[l] = trial_diff[l];
+        if (member_diff[l] < member_diff[best])
+          best = l;
+      }
+  }
+
+  LUZ_STAT_ADD (luz, population_evaluations, (uint64_t)(g + 1) * population);
+  if (member_diff[best] < close_enough)
+    LUZ_STAT_ADD (luz, early_exits, 1);
+
+  for (c = 0; c < luz->coats; c++)
+    coat_levels[c] = members[c][best];
+}
+
+static inline int
+luz_population_generations (Luz *luz)
+{
+  if (luz->generations > 0)
+    return luz->generations;
+  return MAX (1, luz->STOCHASTIC_ITERATIONS / luz->population);
+}
+
+static int gamut_map_rgb (Luz         *luz,
+                          const float *rgb,
+                          float       *mapped);
+
+/* active ink subsets - a colour needs few of many coats, solves with
+ * subsets=1, automatic when the walk would search all of LUZ_SUBSETS_COATS
+ * or more coats exhaustively, as with seeds=0, search a few subsets
+ * predicted from hue instead of all coats. Coats are ordered by the hue
+ * they print alone; the two either side of the target hue make a subset
+ * with the next coat on either side, and with the coat of most opposite
+ * hue for darkening, near neutral targets also try the three coats most
+ * evenly spread around the hue circle. Coats of low chroma, like black,
+ * are in every subset.
+ */
+#define LUZ_SUBSETS_COATS   6
+#define LUZ_SUBSETS_MAX     4
+#define LUZ_SUBSETS_NEUTRAL 15.0f /* chroma below which coats are neutral,
+                                     and targets near neutral */
+
+static inline int
+luz_subsets_enabled (Luz *luz)
+{
+  uint32_t active;
+  if (luz->subsets >= 0)
+    return luz->subsets;
+  active = luz_active_coats (luz, NULL);
+  return luz->solver == LUZ_SOLVER_WALK &&
+         __builtin_popcount (active) >= LUZ_SUBSETS_COATS &&
+         luz_seed_count (luz, active) == 0;
+}
+
+static inline float
+hue_distance (float a,
+              float b)
+{
+  float d = fabsf (a - b);
+  return d > (float) M_PI ? 2.0f * (float) M_PI - d : d;
+}
+
+static inline int
+subsets_add (uint32_t *subset,
+             int       count,
+             uint32_t  coats)
+{
+  int i;
+  for (i = 0; i < count; i++)
+    if (subset[i] == coats)
+      return count;
+  subset[count] = coats;
+  return count + 1;
+}
+
+static LuzHues *
+luz_hues_new (Luz *luz)
+{
+  LuzHues *hues = calloc (sizeof (LuzHues), 1);
+  float    xyz[3], lab[3];
+  float    widest = -1.0f;
+  int      n = 0;
+  int      i, j, k;
+
+  for (i = 0; i < luz->coats; i++)
+  {
+    float levels[LUZ_MAX_COATS] = {0.0f,};
+    levels[i] = 1.0f;
+    luz_coats_to_xyz (luz, levels, xyz);
+    xyz_to_lab (luz, xyz, lab);
+    if (sqrtf (lab[1] * lab[1] + lab[2] * lab[2]) < LUZ_SUBSETS_NEUTRAL)
+      hues->neutral |= 1u << i;
+    else
+    {
+      hues->hue[i] = atan2f (lab[2], lab[1]);
+      for (j = n++; j > 0 && hues->hue[hues->order[j - 1]] > hues->hue[i]; j--)
+        hues->order[j] = hues->order[j - 1];
+      hues->order[j] = i;
+    }
+  }
+  hues->count = n;
+
+  for (i = 0; i < n; i++)
+    for (j = i + 1; j < n; j++)
+      for (k = j + 1; k < n; k++)
+      {
+        float a = hues->hue[hues->order[i]];
+        float b = hues->hue[hues->order[j]];
+        float c = hues->hue[hues->order[k]];
+        float gap = MIN (b - a, MIN (c - b, 2.0f * (float) M_PI - c + a));
+        if (gap > widest)
+        {
+          widest = gap;
+          hues->spread = (1u << hues->order[i]) | (1u << hues->order[j]) |
+                         (1u << hues->order[k]);
+        }
+      }
+  return hues;
+}
+
+/* the hues are found by the first thread needing them, others wait */
+static LuzHues *
+luz_get_hues (Luz *luz)
+{
+  int32_t state = __atomic_load_n (&luz->hues_state, __ATOMIC_ACQUIRE);
+  if (state == LUZ_BUILD_READY)
+    return luz->hues;
+  if (state == LUZ_BUILD_NONE &&
+      __atomic_compare_exchange_n (&luz->hues_state, &state,
+                                   LUZ_BUILD_BUSY, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+  {
+    LUZ_TRACE_BEGIN (luz, "build hues", -1);
+    luz->hues = luz_hues_new (luz);
+    LUZ_STAT_ADD (luz, bytes_allocated, sizeof (LuzHues));
+    LUZ_TRACE_END (luz, "build hues", -1);
+    __atomic_store_n (&luz->hues_state, LUZ_BUILD_READY, __ATOMIC_RELEASE);
+    return luz->hues;
+  }
+  LUZ_TRACE_BEGIN (luz, "wait hues", -1);
+  while (__atomic_load_n (&luz->hues_state, __ATOMIC_ACQUIRE) != LUZ_BUILD_READY)
+    usleep (100);
+  LUZ_TRACE_END (luz, "wait hues", -1);
+  return luz->hues;
+}
+
+static void
+luz_invalidate_hues (Luz *luz)
+{
+  if (luz->hues)
+    LUZ_STAT_ADD (luz, bytes_allocated, -sizeof (LuzHues));
+  free (luz->hues);
+  luz->hues = NULL;
+  luz->hues_state = LUZ_BUILD_NONE;
+}
+
+/* fills in the candidate subsets for rgb as coat masks, returns how many */
+static int
+coat_subsets (Luz         *luz,
+              const float *rgb,
+              uint32_t    *subset)
+{
+  LuzHues       *hues = luz_get_hues (luz);
+  const float   *hue = hues->hue;
+  const int32_t *order = hues->order;
+  int            n = hues->count;
+  float          xyz[3], lab[3];
+  float          target_hue, target_chroma;
+  int            count = 0;
+  int            i, prev, next, opposite;
+
+  if (n <= 3)
+  {
+    subset[0] = (1u << luz->coats) - 1;
+    return 1;
+  }
+
+  rgb_to_xyz (rgb, xyz);
+  xyz_to_lab (luz, xyz, lab);
+  target_hue = atan2f (lab[2], lab[1]);
+  target_chroma = sqrtf (lab[1] * lab[1] + lab[2] * lab[2]);
+
+  for (prev = n - 1, i = 0; i < n && hue[order[i]] <= target_hue; i++)
+    prev = i;
+  next = (prev + 1) % n;
+  opposite = order[0];
+  for (i = 1; i < n; i++)
+    if (hue_distance (hue[order[i]], target_hue) >
+        hue_distance (hue[opposite], target_hue))
+      opposite = order[i];
+
+#define SUBSET_BIT(k) (1u << order[((k) + n) % n])
+  count = subsets_add (subset, count, hues->neutral | SUBSET_BIT (prev - 1) |
+                                      SUBSET_BIT (prev) | SUBSET_BIT (next));
+  count = subsets_add (subset, count, hues->neutral | SUBSET_BIT (prev) |
+                                      SUBSET_BIT (next) | SUBSET_BIT (next + 1));
+  count = subsets_add (subset, count, hues->neutral | SUBSET_BIT (prev) |
+                                      SUBSET_BIT (next) | (1u << opposite));
+#undef SUBSET_BIT
+  if (target_chroma < LUZ_SUBSETS_NEUTRAL)
+    count = subsets_add (subset, count, hues->neutral | hues->spread);
+  return count;
+}
+
+/* the solver pipeline over the active coats */
+static inline void
+_rgb_to_coats_active (Luz         *luz,
+                      const float *rgb,
+                      Spectrum    *spectrum,
+                      float       *coat_levels,
+                      uint32_t    *rng,
+                      uint32_t     active)
+{
+  if (luz->solver == LUZ_SOLVER_POPULATION && !spectrum)
+  { /* the population covers the space, no exhaustive search needed */
+    luz_rgb_to_coats_population (luz, rgb, coat_levels, rng, active,
+                                 luz->population,
+                                 luz_population_generations (luz));
+    return;
+  }
+  if (luz_seed_count (luz, active) > 0 && !spectrum)
+    luz_rgb_to_coats_seeded (luz, rgb, coat_levels, active,
+                             luz_seed_count (luz, active));
+  else
+    luz_rgb_to_coats_griddy (luz, rgb, spectrum, coat_levels, active);
+  luz_rgb_to_coats_stochastic (luz, rgb, spectrum, coat_levels, rng, active,
+                               luz->STOCHASTIC_ITERATIONS,
+                               luz->STOCHASTIC_DIFFUSION0,
+                               luz->STOCHASTIC_DIFFUSION1);
+}
+
+static inline void _rgb_to_coats (Luz  *luz, const float *rgb, Spectrum *spectrum, float *coat_levels, uint32_t *rng)
+{
+  float    mapped[3];
+  int      fixed = luz_black_coat (luz, spectrum);
+  uint32_t active = luz_active_coats (luz, spectrum);
+  uint32_t subset[LUZ_SUBSETS_MAX];
+  int      subsets = 1;
+  float    target[3];
+  float    bestdiff = 1e30f;
+  float    best[LUZ_MAX_COATS];
+  int      i, c;
+
+  if (!spectrum && gamut_map_rgb (luz, rgb, mapped))
+    rgb = mapped;
+  if (!spectrum && luz_discrete (luz))
+  {
+    luz_rgb_to_coats_seeded (luz, rgb, coat_levels, active,
+                             luz_primaries_k (luz));
+    return;
+  }
+  if (fixed >= 0)
+    coat_levels[fixed] = black_generation (luz, rgb);
+  if (!spectrum && luz_subsets_enabled (luz))
+    subsets = coat_subsets (luz, rgb, subset);
+  if (subsets <= 1)
+  {
+    _rgb_to_coats_active (luz, rgb, spectrum, coat_levels, rng, active);
+    return;
+  }
+
+  objective_target (luz, rgb, target);
+  for (i = 0; i < subsets; i++)
+  {
+    float levels[LUZ_MAX_COATS];
+    float diff;
+    for (c = 0; c < luz->coats; c++)
+      levels[c] = COAT_ACTIVE (active, c) ? 0.0f : coat_levels[c];
+    _rgb_to_coats_active (luz, rgb, NULL, levels, rng, active & subset[i]);
+    diff = objective_diff (luz, target, levels);
+    if (diff < bestdiff)
+    {
+      bestdiff = diff;
+      memcpy (best, levels, sizeof (float) * luz->coats);
+    }
+  }
+  memcpy (coat_levels, best, sizeof (float) * luz->coats);
+}
+
+/* re-solve starting from the solution found for a previous configuration,
+ * skipping the exhaustive search and subsets.
+ */
+static inline void _rgb_to_coats_warm (Luz *luz, const float *rgb, Spectrum *spectrum, float *coat_levels, uint32_t *rng)
+{
+  float    mapped[3];
+  int      fixed = luz_black_coat (luz, spectrum);
+  uint32_t active = luz_active_coats (luz, spectrum);
+  if (!spectrum && gamut_map_rgb (luz, rgb, mapped))
+    rgb = mapped;
+  if (!spectrum && luz_discrete (luz))
+  { /* picking a primary is cheaper than any warm start */
+    luz_rgb_to_coats_seeded (luz, rgb, coat_levels, active,
+                             luz_primaries_k (luz));
+    return;
+  }
+  if (fixed >= 0)
+    coat_levels[fixed] = black_generation (luz, rgb);
+  coats_constrain (luz, coat_levels, active);
+
+  if (luz->solver == LUZ_SOLVER_POPULATION && !spectrum)
+  {
+    luz_rgb_to_coats_population (luz, rgb, coat_levels, rng, active,
+                                 luz->population,
+                                 luz_population_generations (luz));
+    return;
+  }
+  luz_rgb_to_coats_stochastic (luz, rgb, spectrum, coat_levels, rng, active,
+                               luz->STOCHASTIC_ITERATIONS,
+                               luz->STOCHASTIC_DIFFUSION0,
+                               luz->STOCHASTIC_DIFFUSION1);
+}
+
+static inline float
+lab_f_inverse (float t)
+{
+  if (t > 6.0f / 29.0f)
+    return t * t * t;
+  return (t - 16.0f / 116.0f) / 7.787037f;
+}
+
+static inline void
+lab_to_xyz (const float *white_xyz,
+            const float *lab,
+            float       *xyz)
+{
+  float fy = (lab[0] + 16.0f) / 116.0f;
+  xyz[0] = white_xyz[0] * lab_f_inverse (fy + lab[1] / 500.0f);
+  xyz[1] = white_xyz[1] * lab_f_inverse (fy);
+  xyz[2] = white_xyz[2] * lab_f_inverse (fy - lab[2] / 200.0f);
+}
+
+/* the gamut boundary, see LuzGamut */
+
+typedef struct _GamutBuild GamutBuild;
+
+struct _GamutBuild
+{
+  int    steps; /* lattice levels per coat */
+  float *lab;   /* indexed by lattice index */
+};
+
+/* evaluates lattice samples, those above the coverage limit scaled down to
+ * it, which puts them on the part of the boundary the limit makes */
+static void
+gamut_evaluate (Luz  *luz,
+                void *data,
+                int   start,
+                int   end)
+{
+  GamutBuild *w = data;
+  int coats = luz->coats;
+  int index;
+
+  for (index = start; index < end; index += LUZ_LANES)
+  {
+    float levels[LUZ_MAX_COATS][LUZ_LANES] = {{0.0f,},};
+    float xyz[3][LUZ_LANES];
+    int lanes = MIN (LUZ_LANES, end - index);
+    int l, c;
+
+    for (l = 0; l < lanes; l++)
+    {
+      int rest = index + l;
+      float coatsum = 0.0f;
+      for (c = coats - 1; c >= 0; c--)
+      {
+        levels[c][l] = (float)(rest % w->steps) / (w->steps - 1);
+        coatsum += levels[c][l];
+        rest /= w->steps;
+      }
+      if (coatsum > luz->coverage_limit)
+        for (c = 0; c < coats; c++)
+          levels[c][l] *= luz->coverage_limit / coatsum;
+    }
+    coats_to_xyz_lanes (luz, levels, xyz);
+    for (l = 0; l < lanes; l++)
+    {
+      float lane_xyz[3] = {xyz[0][l], xyz[1][l], xyz[2][l]};
+      xyz_to_lab (luz, lane_xyz, &w->lab[(index + l) * 3]);
+    }
+  }
+}
+
+/* the distance of lab from the centre, and its position in segments; u
+ * along the hues and v along the elevations, segment centres at .5
+ */
+static inline float
+gamut_polar (const LuzGamut *gamut,
+             const float    *lab,
+             float          *u,
+             float          *v)
+{
+  float dl = lab[0] - gamut->centre[0];
+  float da = lab[1] - gamut->centre[1];
+  float db = lab[2] - gamut->centre[2];
+  float chroma = sqrtf (da * da + db * db);
+  *u = (fast_atan2f (db, da) + (float) M_PI) *
+       (LUZ_GAMUT_HUES / (2.0f * (float) M_PI));
+  *v = (fast_atan2f (dl, chroma) + (float) M_PI_2) *
+       (LUZ_GAMUT_ELEVATIONS / (float) M_PI);
+  return sqrtf (chroma * chroma + dl * dl);
+}
+
+static inline void
+gamut_add (const LuzGamut *gamut,
+           float           segments[LUZ_GAMUT_ELEVATIONS][LUZ_GAMUT_HUES],
+           const float    *lab)
+{
+  float u, v;
+  float radius = gamut_polar (gamut, lab, &u, &v);
+  int   hue = MIN ((int) u, LUZ_GAMUT_HUES - 1);
+  int   elevation = MIN ((int) v, LUZ_GAMUT_ELEVATIONS - 1);
+  segments[elevation][hue] = MAX (segments[elevation][hue], radius);
+}
+
+/* the boundary distance at u, v - bilinear between segment centres, hues
+ * wrapping around */
+static inline float
+gamut_boundary (const float segments[LUZ_GAMUT_ELEVATIONS][LUZ_GAMUT_HUES],
+                float       u,
+                float       v)
+{
+  int   u0 = (int) floorf (u - 0.5f);
+  int   v0 = (int) floorf (v - 0.5f);
+  float du = u - 0.5f - u0;
+  float dv = v - 0.5f - v0;
+  int   u1 = (u0 + 1) % LUZ_GAMUT_HUES;
+  int   v1 = MIN (v0 + 1, LUZ_GAMUT_ELEVATIONS - 1);
+  u0 = (u0 + LUZ_GAMUT_HUES) % LUZ_GAMUT_HUES;
+  v0 = MAX (v0, 0);
+  return LERP (LERP (segments[v0][u0], segments[v0][u1], du),
+               LERP (segments[v1][u0], segments[v1][u1], du), dv);
+}
+
+/* segments no sample fell in, negative, get the mean of their neighbours */
+static void
+gamut_fill (float segments[LUZ_GAMUT_ELEVATIONS][LUZ_GAMUT_HUES])
+{
+  float prev[LUZ_GAMUT_ELEVATIONS][LUZ_GAMUT_HUES];
+  int   filled = 1;
+  int   u, v;
+
+  while (filled)
+  {
+    filled = 0;
+    memcpy (prev, segments, sizeof (prev));
+    for (v = 0; v < LUZ_GAMUT_ELEVATIONS; v++)
+      for (u = 0; u < LUZ_GAMUT_HUES; u++)
+      {
+        const float *n[4] = {
+          &prev[v][(u + 1) % LUZ_GAMUT_HUES],
+          &prev[v][(u + LUZ_GAMUT_HUES - 1) % LUZ_GAMUT_HUES],
+          v > 0 ? &prev[v - 1][u] : NULL,
+          v < LUZ_GAMUT_ELEVATIONS - 1 ? &prev[v + 1][u] : NULL};
+        float sum = 0.0f;
+        int   count = 0, i;
+        if (prev[v][u] >= 0.0f)
+          continue;
+        for (i = 0; i < 4; i++)
+          if (n[i] && *n[i] >= 0.0f)
+          {
+            sum += *n[i];
+            count++;
+          }
+        if (count)
+        {
+          segments[v][u] = sum / count;
+          filled = 1;
+        }
+      }
+  }
+  for (v = 0; v < LUZ_GAMUT_ELEVATIONS; v++)
+    for (u = 0; u < LUZ_GAMUT_HUES; u++)
+      segments[v][u] = MAX (segments[v][u], 0.0f);
+}
+
+/* evaluates the coat lattice, split over the online cores, and the faces
+ * of the RGB cube, keeping the segment maxima of both */
+static LuzGamut *
+luz_gamut_new (Luz *luz)
+{
+  LuzGamut  *gamut = calloc (sizeof (LuzGamut), 1);
+  GamutBuild build;
+  int        coats = luz->coats;
+  int        steps = (int)(1.0 / INCREMENT + 0.5) + 1;
+  int        total = 1;
+  float      lmin = 100.0f, lmax = 0.0f;
+  int        i, j, c;
+
+  while (steps > 2 && pow (steps, coats) > LUZ_GAMUT_SAMPLES)
+    steps--;
+  for (c = 0; c < coats; c++)
+    total *= steps;
+
+  build = (GamutBuild){steps, malloc (sizeof (float) * 3 * total)};
+  luz_parallel_for (luz, total, 64 * LUZ_LANES, gamut_evaluate, &build);
+
+  for (i = 0; i < total; i++)
+  {
+    lmin = MIN (lmin, build.lab[i * 3]);
+    lmax = MAX (lmax, build.lab[i * 3]);
+  }
+  gamut->centre[0] = (lmin + lmax) / 2;
+
+  for (i = 0; i < LUZ_GAMUT_ELEVATIONS; i++)
+    for (j = 0; j < LUZ_GAMUT_HUES; j++)
+      gamut->radius[i][j] = gamut->source[i][j] = -1.0f;
+  for (i = 0; i < total; i++)
+    gamut_add (gamut, gamut->radius, &build.lab[i * 3]);
+  free (build.lab);
+
+  for (c = 0; c < 6; c++) /* the faces of the RGB cube */
+    for (i = 0; i <= 32; i++)
+      for (j = 0; j <= 32; j++)
+      {
+        float rgb[3], xyz[3], lab[3];
+        rgb[c % 3] = c / 3;
+        rgb[(c + 1) % 3] = i / 32.0f;
+        rgb[(c + 2) % 3] = j / 32.0f;
+        rgb_to_xyz (rgb, xyz);
+        xyz_to_lab (luz, xyz, lab);
+        gamut_add (gamut, gamut->source, lab);
+      }
+
+  gamut_fill (gamut->radius);
+  gamut_fill (gamut->source);
+  return gamut;
+}
+
+/* the boundary is built by the first thread needing it, others wait */
+static LuzGamut *
+luz_get_gamut (Luz *luz)
+{
+  int32_t state = __atomic_load_n (&luz->gamut_state, __ATOMIC_ACQUIRE);
+  if (state == LUZ_BUILD_READY)
+    return luz->gamut;
+  if (state == LUZ_BUILD_NONE &&
+      __atomic_compare_exchange_n (&luz->gamut_state, &state,
+                                   LUZ_BUILD_BUSY, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+  {
+    LUZ_TRACE_BEGIN (luz, "build gamut", -1);
+    luz->gamut = luz_gamut_new (luz);
+    LUZ_STAT_ADD (luz, bytes_allocated, sizeof (LuzGamut));
+    LUZ_TRACE_END (luz, "build gamut", -1);
+    __atomic_store_n (&luz->gamut_state, LUZ_BUILD_READY, __ATOMIC_RELEASE);
+    return luz->gamut;
+  }
+  LUZ_TRACE_BEGIN (luz, "wait gamut", -1);
+  while (__atomic_load_n (&luz->gamut_state, __ATOMIC_ACQUIRE) != LUZ_BUILD_READY)
+    usleep (100);
+  LUZ_TRACE_END (luz, "wait gamut", -1);
+  return luz->gamut;
+}
+
+static void
+luz_invalidate_gamut (Luz *luz)
+{
+  if (luz->gamut)
+    LUZ_STAT_ADD (luz, bytes_allocated, -sizeof (LuzGamut));
+  free (luz->gamut);
+  luz->gamut = NULL;
+  luz->gamut_state = LUZ_BUILD_NONE;
+}
+
+/* moves lab towards the centre as gamutmap= asks, returning whether it
+ * was moved */
+static int
+gamut_map_lab (Luz            *luz,
+               const LuzGamut *gamut,
+               float          *lab)
+{
+  float u, v;
+  float radius = gamut_polar (gamut, lab, &u, &v);
+  float boundary = gamut_boundary (gamut->radius, u, v);
+  float mapped = radius;
+  int   c;
+
+  if (luz->gamut_map == LUZ_GAMUT_MAP_COMPRESS)
+  {
+    float source = gamut_boundary (gamut->source, u, v);
+    float knee = boundary * LUZ_GAMUT_KNEE;
+    if (radius > knee && source > boundary)
+      mapped = knee + (boundary - knee) *
+                      MIN (1.0f, (radius - knee) / (source - knee));
+  }
+  mapped = MIN (mapped, boundary);
+  if (mapped >= radius)
+    return 0;
+
+  for (c = 0; c < 3; c++)
+    lab[c] = gamut->centre[c] + (lab[c] - gamut->centre[c]) * mapped / radius;
+  return 1;
+}
+
+/* the target a solve aims for, linear RGB moved into the gamut */
+static int
+gamut_map_rgb (Luz         *luz,
+               const float *rgb,
+               float       *mapped)
+{
+  float xyz[3], lab[3];
+
+  if (luz->gamut_map == LUZ_GAMUT_MAP_NONE)
+    return 0;
+  rgb_to_xyz (rgb, xyz);
+  xyz_to_lab (luz, xyz, lab);
+  if (!gamut_map_lab (luz, luz_get_gamut (luz), lab))
+    return 0;
+  lab_to_xyz (luz->white_xyz, lab, xyz);
+  xyz_to_rgb (xyz, mapped);
+  LUZ_STAT_ADD (luz, gamut_mapped, 1);
+  return 1;
+}
+
+int
+luz_in_gamut (Luz         *luz,
+              const float *rgb)
+{
+  LuzGamut *gamut = luz_get_gamut (luz);
+  float xyz[3], lab[3], u, v;
+  float radius;
+
+  rgb_to_xyz (rgb, xyz);
+  xyz_to_lab (luz, xyz, lab);
+  radius = gamut_polar (gamut, lab, &u, &v);
+  return radius <= gamut_boundary (gamut->radius, u, v);
+}
+
+/* the linear RGB a table node is solved for; for Lab nodes this is not
+ * clipped, colours outside the RGB gamut still get their closest match.
+ */
+static inline void
+lut_node_target (Luz     *luz,
+                 LuzSpace space,
+                 int      dim,
+                 int      ri,
+                 int      gi,
+                 int      bi,
+                 float   *rgb)
+{
+  if (space == LUZ_SPACE_LAB)
+  {
+    float lab[3] = {100.0f * ri / (dim - 1),
+                    LAB_AB_RANGE * (2.0f * gi / (dim - 1) - 1.0f),
+                    LAB_AB_RANGE * (2.0f * bi / (dim - 1) - 1.0f)};
+    float xyz[3];
+    lab_to_xyz (luz->white_xyz, lab, xyz);
+    xyz_to_rgb (xyz, rgb);
+  }
+  else
+  {
+    rgb[0] = (float)ri / (dim - 1);
+    rgb[1] = (float)gi / (dim - 1);
+    rgb[2] = (float)bi / (dim - 1);
+  }
+}
+
+/* the CIEDE2000 difference between the colour a cell is solved for, moved
+ * into the gamut as the solvers see it, and the colour its levels print
+ */
+static float
+cell_residual (Luz         *luz,
+               const float *rgb,
+               const float *coat_levels)
+{
+  float xyz[3], lab[3], solved[3];
+  rgb_to_xyz (rgb, xyz);
+  xyz_to_lab (luz, xyz, lab);
+  if (luz->gamut_map != LUZ_GAMUT_MAP_NONE)
+    gamut_map_lab (luz, luz_get_gamut (luz), lab);
+  luz_coats_to_xyz (luz, coat_levels, xyz);
+  xyz_to_lab (luz, xyz, solved);
+  return delta_e2000 (lab, solved);
+}
+
+/* cells are claimed by atomically moving them to LUZ_CELL_BUSY, the thread
+ * that wins solves the cell and publishes it with a release store, other
+ * threads needing it sleep until it is defined.
+ */
+static inline float *
+ensure_lut (Luz     *luz,
+            LuzSpace space,
+            int      ri,
+            int      gi,
+            int      bi)
+{
+  int     dim = luz->lut_dim;
+  int     l_index = lut_index (dim, ri, gi, bi);
+  InkMix *cell = space == LUZ_SPACE_LAB ? &luz->lab_lut[l_index] :
+                                          &luz->lut[l_index];
+  int32_t state = __atomic_load_n (&cell->defined, __ATOMIC_ACQUIRE);
+
+  if (state == LUZ_CELL_DEFINED)
+    return &cell->level[0];
+
+  LUZ_STAT_ADD (luz, lut_misses, 1);
+
+  if ((state == LUZ_CELL_UNDEFINED || state == LUZ_CELL_STALE) &&
+      __atomic_compare_exchange_n (&cell->defined, &state, LUZ_CELL_BUSY, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+  {
+    float trgb[3];
+    uint32_t rng = luz_random_seed (l_index + space * dim * dim * dim);
+    lut_node_target (luz, space, dim, ri, gi, bi, trgb);
+    LUZ_TRACE_BEGIN (luz, "solve cell", l_index);
+    if (state == LUZ_CELL_STALE)
+      _rgb_to_coats_warm (luz, trgb, NULL, &cell->level[0], &rng);
+    else
+      _rgb_to_coats (luz, trgb, NULL, &cell->level[0], &rng);
+    cell->residual = cell_residual (luz, trgb, &cell->level[0]);
+    LUZ_TRACE_END (luz, "solve cell", l_index);
+    __atomic_store_n (&cell->defined, LUZ_CELL_DEFINED, __ATOMIC_RELEASE);
+    LUZ_STAT_ADD (luz, cells_solved, 1);
+  }
+
+  if (__atomic_load_n (&cell->defined, __ATOMIC_ACQUIRE) != LUZ_CELL_DEFINED)
+  {
+    struct timespec start, end;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    LUZ_TRACE_BEGIN (luz, "wait cell", l_index);
+    while (__atomic_load_n (&cell->defined, __ATOMIC_ACQUIRE) != LUZ_CELL_DEFINED)
+      usleep (100); // another thread is computing it, sleep
+    LUZ_TRACE_END (luz, "wait cell", l_index);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    LUZ_STAT_ADD (luz, wait_ns, (end.tv_sec - start.tv_sec) * 1000000000ll +
+                                (end.tv_nsec - start.tv_nsec));
+  }
+  return &cell->level[0];
+}
+
+static inline void
+lerp_coats (int          coats,
+                float       *coat_res,
+                const float *coata,
+                const float *coatb,
+                float        delta)
+{
+  int i;
+  for (i = 0; i < coats; i++)
+    coat_res[i] = coata[i]  * (1.0 - delta) + coatb[i] * delta;
+}
+
+/* snaps coats with discrete levels= to the nearest of their levels */
+static inline void
+quantise_coats (Luz   *luz,
+                float *coat_levels)
+{
+  int i;
+  for (i = 0; i < luz->coats; i++)
+  {
+    int levels = luz->coat_def[i].levels;
+    if (levels > 1)
+      coat_levels[i] =
+        floorf (CLAMP (coat_levels[i], 0.0f, 1.0f) * (levels - 1) + 0.5f) /
+        (levels - 1);
+  }
+}
+
+/* pos is the position in the table, 0.0 - 1.0 along each axis */
+static inline void
+lut_interpolate (Luz         *luz,
+                 LuzSpace     space,
+                 const float *pos,
+                 float       *coat_levels,
+                 int          level)
+{
+  int dim = luz->lut_dim;
+  int stride = lut_stride_for_level (dim, level);
+  float rdelta, gdelta, bdelta;
+  int r1, g1, b1;
+  int r0 = lut_indice (dim, pos[0], stride, &r1, &rdelta);
+  int g0 = lut_indice (dim, pos[1], stride, &g1, &gdelta);
+  int b0 = lut_indice (dim, pos[2], stride, &b1, &bdelta);
+  float *coat_corner[8];
+  float  temp1[LUZ_MAX_COATS];
+  float  temp2[LUZ_MAX_COATS];
+  float  temp3[LUZ_MAX_COATS];
+  float  temp4[LUZ_MAX_COATS];
+
+/* numbering of corners, and positions of R,G,B axes
+      6
+      /\
+    /   \
+ 7/   d  \5
+  |\     /|
+  |  \4/  |
+ 3\B G|2  |
+   \  |  /1
+     \|/R
+      0       */
+
+  coat_corner[0] = ensure_lut (luz, space, r0, g0, b0);
+  coat_corner[1] = ensure_lut (luz, space, r1, g0, b0);
+  coat_corner[2] = ensure_lut (luz, space, r1, g0, b1);
+  coat_corner[3] = ensure_lut (luz, space, r0, g0, b1);
+
+  coat_corner[4] = ensure_lut (luz, space, r0, g1, b0);
+  coat_corner[5] = ensure_lut (luz, space, r1, g1, b0);
+  coat_corner[6] = ensure_lut (luz, space, r1, g1, b1);
+  coat_corner[7] = ensure_lut (luz, space, r0, g1, b1);
+  LUZ_STAT_ADD (luz, lut_lookups, 8);
+
+  lerp_coats (luz->coats, temp1, coat_corner[0], coat_corner[1], rdelta);
+  lerp_coats (luz->coats, temp2, coat_corner[3], coat_corner[2], rdelta);
+  lerp_coats (luz->coats, temp3, coat_corner[4], coat_corner[5], rdelta);
+  lerp_coats (luz->coats, temp4, coat_corner[7], coat_corner[6], rdelta);
+  lerp_coats (luz->coats, temp1, temp1, temp3, gdelta);
+  lerp_coats (luz->coats, temp2, temp2, temp4, gdelta);
+  lerp_coats (luz->coats, coat_levels, temp1, temp2, bdelta);
+}
+
+/* the adaptive table, see LuzOctree */
+
+static const int octree_corner[8][3] = {
+  {0, 0, 0}, {1, 0, 0}, {1, 0, 1}, {0, 0, 1},
+  {0, 1, 0}, {1, 1, 0}, {1, 1, 1}, {0, 1, 1}};
+
+typedef struct _OctreeBuild OctreeBuild;
+
+struct _OctreeBuild
+{
+  LuzOctree *tree;
+  int32_t   *vertex_at;     /* LUZ_OCTREE_SIDE^3 lattice points, or -1 */
+  int32_t   *lattice;       /* the lattice point of each vertex */
+  int32_t    capacity;      /* of vertices */
+  int32_t    solved;        /* vertices before this are solved */
+  int32_t    node_capacity;
+  int16_t  (*origin)[3];    /* lattice position of each node */
+  int8_t    *depth;
+};
+
+typedef struct _OctreeResidual OctreeResidual;
+
+struct _OctreeResidual
+{
+  float   de;
+  int32_t node;
+};
+
+static int
+octree_vertex (OctreeBuild *b,
+               int          x,
+               int          y,
+               int          z)
+{
+  LuzOctree *tree = b->tree;
+  int index = (z * LUZ_OCTREE_SIDE + y) * LUZ_OCTREE_SIDE + x;
+  if (b->vertex_at[index] >= 0)
+    return b->vertex_at[index];
+  if (tree->vertices == b->capacity)
+  {
+    b->capacity *= 2;
+    tree->level = realloc (tree->level,
+                           sizeof (float) * MAX (tree->coats, 1) * b->capacity);
+    b->lattice = realloc (b->lattice, sizeof (int32_t) * b->capacity);
+  }
+  b->lattice[tree->vertices] = index;
+  return b->vertex_at[index] = tree->vertices++;
+}
+
+static int
+octree_node_new (OctreeBuild *b,
+                 int          x,
+                 int          y,
+                 int          z,
+                 int          depth)
+{
+  LuzOctree *tree = b->tree;
+  int size = 1 << (LUZ_OCTREE_DEPTH - depth);
+  int n = tree->nodes++;
+  int i;
+  if (n == b->node_capacity)
+  {
+    b->node_capacity *= 2;
+    tree->node = realloc (tree->node, sizeof (LuzOctreeNode) * b->node_capacity);
+    b->origin = realloc (b->origin, sizeof (b->origin[0]) * b->node_capacity);
+    b->depth = realloc (b->depth, b->node_capacity);
+  }
+  tree->node[n].child = 0;
+  for (i = 0; i < 8; i++)
+    tree->node[n].corner[i] = octree_vertex (b, x + octree_corner[i][0] * size,
+                                                y + octree_corner[i][1] * size,
+                                                z + octree_corner[i][2] * size);
+  b->origin[n][0] = x;
+  b->origin[n][1] = y;
+  b->origin[n][2] = z;
+  b->depth[n] = depth;
+  return n;
+}
+
+/* splits a leaf in 8, with the children stored together in octant order */
+static int
+octree_split (OctreeBuild *b,
+              int          n)
+{
+  int half = 1 << (LUZ_OCTREE_DEPTH - b->depth[n] - 1);
+  int first = b->tree->nodes;
+  int octant;
+  for (octant = 0; octant < 8; octant++)
+    octree_node_new (b, b->origin[n][0] + (octant & 1 ? half : 0),
+                        b->origin[n][1] + (octant & 2 ? half : 0),
+                        b->origin[n][2] + (octant & 4 ? half : 0),
+                        b->depth[n] + 1);
+  b->tree->node[n].child = first;
+  return first;
+}
+
+static void
+octree_solve (Luz  *luz,
+              void *data,
+              int   start,
+              int   end)
+{
+  OctreeBuild *b = data;
+  int i;
+  for (i = start; i < end; i++)
+  {
+    int      v = b->solved + i;
+    int      index = b->lattice[v];
+    float    rgb[3] = {index % LUZ_OCTREE_SIDE,
+                       index / LUZ_OCTREE_SIDE % LUZ_OCTREE_SIDE,
+                       index / LUZ_OCTREE_SIDE / LUZ_OCTREE_SIDE};
+    float    levels[LUZ_MAX_COATS] = {0.0f,};
+    uint32_t rng = luz_random_seed (index);
+    int      c;
+    for (c = 0; c < 3; c++)
+      rgb[c] /= LUZ_OCTREE_SIDE - 1;
+    _rgb_to_coats (luz, rgb, NULL, levels, &rng);
+    memcpy (&b->tree->level[v * b->tree->coats], levels,
+            sizeof (float) * b->tree->coats);
+  }
+  LUZ_STAT_ADD (luz, cells_solved, end - start);
+}
+
+/* solves the vertices added since the last call, in parallel */
+static void
+octree_solve_pending (Luz         *luz,
+                      OctreeBuild *b)
+{
+  luz_parallel_for (luz, b->tree->vertices - b->solved, 4, octree_solve, b);
+  b->solved = b->tree->vertices;
+}
+
+static int
+octree_residual_compare (const void *a,
+                         const void *b)
+{
+  float de_a = ((const OctreeResidual *) a)->de;
+  float de_b = ((const OctreeResidual *) b)->de;
+  return de_a < de_b ? 1 : de_a > de_b ? -1 : 0;
+}
+
+/* the CIEDE2000 difference between the leaf interpolated at its centre and
+ * the direct solve there */
+static float
+octree_residual (Luz       *luz,
+                 LuzOctree *tree,
+                 int        n,
+                 int        centre)
+{
+  float interpolated[LUZ_MAX_COATS] = {0.0f,};
+  float xyz[3], lab[3], direct_lab[3];
+  int i, c;
+  for (i = 0; i < 8; i++)
+    for (c = 0; c < tree->coats; c++)
+      interpolated[c] += tree->level[tree->node[n].corner[i] * tree->coats + c] / 8;
+  luz_coats_to_xyz (luz, interpolated, xyz);
+  xyz_to_lab (luz, xyz, lab);
+  luz_coats_to_xyz (luz, &tree->level[centre * tree->coats], xyz);
+  xyz_to_lab (luz, xyz, direct_lab);
+  return delta_e2000 (lab, direct_lab);
+}
+
+/* drops the vertices only solved for measuring residuals */
+static void
+octree_compact (LuzOctree *tree)
+{
+  int32_t *remap = malloc (sizeof (int32_t) * MAX (tree->vertices, 1));
+  float   *level = malloc (sizeof (float) * MAX (tree->coats, 1) *
+                           MAX (tree->vertices, 1));
+  int      vertices = 0;
+  int      n, i;
+
+  for (i = 0; i < tree->vertices; i++)
+    remap[i] = -1;
+  for (n = 0; n < tree->nodes; n++)
+    for (i = 0; i < 8; i++)
+    {
+      int v = tree->node[n].corner[i];
+      if (remap[v] < 0)
+      {
+        remap[v] = vertices;
+        memcpy (&level[vertices * tree->coats], &tree->level[v * tree->coats],
+                sizeof (float) * tree->coats);
+        vertices++;
+      }
+      tree->node[n].corner[i] = remap[v];
+    }
+  free (tree->level);
+  free (remap);
+  tree->vertices = vertices;
+  tree->level = realloc (level, sizeof (float) * MAX (tree->coats, 1) *
+                                MAX (vertices, 1));
+}
+
+/* builds the tree from a grid of 2^LUZ_OCTREE_BASE cells per axis, measuring
+ * the residual of each new leaf and splitting the worst ones first, depth by
+ * depth, until the residuals are within refine= or table_nodes= vertices
+ * have been solved.
+ */
+static LuzOctree *
+luz_octree_new (Luz *luz)
+{
+  LuzOctree      *tree = calloc (sizeof (LuzOctree), 1);
+  OctreeBuild     b = {tree, NULL, NULL, 1024, 0, 1024, NULL, NULL};
+  int             side3 = LUZ_OCTREE_SIDE * LUZ_OCTREE_SIDE * LUZ_OCTREE_SIDE;
+  int             leaves_capacity = 64;
+  int            *leaves = malloc (sizeof (int) * leaves_capacity);
+  int             leaf_count = 0;
+  OctreeResidual *residual = NULL;
+  int             depth, i;
+
+  tree->coats = luz->coats;
+  tree->node  = malloc (sizeof (LuzOctreeNode) * b.node_capacity);
+  tree->level = malloc (sizeof (float) * MAX (tree->coats, 1) * b.capacity);
+  b.vertex_at = malloc (sizeof (int32_t) * side3);
+  b.lattice   = malloc (sizeof (int32_t) * b.capacity);
+  b.origin    = malloc (sizeof (b.origin[0]) * b.node_capacity);
+  b.depth     = malloc (b.node_capacity);
+  for (i = 0; i < side3; i++)
+    b.vertex_at[i] = -1;
+
+  octree_node_new (&b, 0, 0, 0, 0);
+  leaves[leaf_count++] = 0;
+
+  for (depth = 0; depth < LUZ_OCTREE_DEPTH && leaf_count; depth++)
+  {
+    int candidates = 0;
+    int new_count = 0;
+    int *next;
+
+    residual = realloc (residual, sizeof (OctreeResidual) * leaf_count);
+    if (depth < LUZ_OCTREE_BASE)
+    {
+      for (i = 0; i < leaf_count; i++)
+        residual[candidates++] = (OctreeResidual){1e30f, leaves[i]};
+    }
+    else
+    {
+      int32_t *centre = malloc (sizeof (int32_t) * leaf_count);
+      int measured = 0;
+      int half = 1 << (LUZ_OCTREE_DEPTH - depth - 1);
+      for (i = 0; i < leaf_count && tree->vertices < luz->table_nodes; i++)
+      {
+        int n = leaves[i];
+        centre[i] = octree_vertex (&b, b.origin[n][0] + half,
+                                       b.origin[n][1] + half,
+                                       b.origin[n][2] + half);
+        measured++;
+      }
+      octree_solve_pending (luz, &b);
+      for (i = 0; i < measured; i++)
+      {
+        float de = octree_residual (luz, tree, leaves[i], centre[i]);
+        if (de > luz->refine)
+          residual[candidates++] = (OctreeResidual){de, leaves[i]};
+      }
+      free (centre);
+      qsort (residual, candidates, sizeof (OctreeResidual),
+             octree_residual_compare);
+    }
+
+    next = malloc (sizeof (int) * MAX (candidates, 1) * 8);
+    for (i = 0; i < candidates; i++)
+    {
+      int first, octant;
+      if (depth >= LUZ_OCTREE_BASE && tree->vertices >= luz->table_nodes)
+        break;
+      first = octree_split (&b, residual[i].node);
+      for (octant = 0; octant < 8; octant++)
+        next[new_count++] = first + octant;
+    }
+    octree_solve_pending (luz, &b);
+    free (leaves);
+    leaves = next;
+    leaf_count = new_count;
+  }
+
+  free (residual);
+  free (leaves);
+  free (b.depth);
+  free (b.origin);
+  free (b.lattice);
+  free (b.vertex_at);
+  octree_compact (tree);
+  tree->node = realloc (tree->node, sizeof (LuzOctreeNode) * tree->nodes);
+  return tree;
+}
+
+static void
+luz_octree_destroy (LuzOctree *tree)
+{
+  if (!tree)
+    return;
+  free (tree->node);
+  free (tree->level);
+  free (tree);
+}
+
+static size_t
+luz_octree_memory_usage (LuzOctree *tree)
+{
+  return sizeof (LuzOctree) + sizeof (LuzOctreeNode) * tree->nodes +
+         sizeof (float) * tree->coats * tree->vertices;
+}
+
+/* the tree is built by the first thread needing it, others wait */
+static LuzOctree *
+luz_get_octree (Luz *luz)
+{
+  int32_t state = __atomic_load_n (&luz->octree_state, __ATOMIC_ACQUIRE);
+  if (state == LUZ_BUILD_READY)
+    return luz->octree;
+  if (state == LUZ_BUILD_NONE &&
+      __atomic_compare_exchange_n (&luz->octree_state, &state,
+                                   LUZ_BUILD_BUSY, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+  {
+    LUZ_TRACE_BEGIN (luz, "build octree", -1);
+    luz->octree = luz_octree_new (luz);
+    LUZ_STAT_ADD (luz, bytes_allocated, luz_octree_memory_usage (luz->octree));
+    LUZ_TRACE_END (luz, "build octree", -1);
+    __atomic_store_n (&luz->octree_state, LUZ_BUILD_READY, __ATOMIC_RELEASE);
+    return luz->octree;
+  }
+  LUZ_TRACE_BEGIN (luz, "wait octree", -1);
+  while (__atomic_load_n (&luz->octree_state, __ATOMIC_ACQUIRE) != LUZ_BUILD_READY)
+    usleep (100);
+  LUZ_TRACE_END (luz, "wait octree", -1);
+  return luz->octree;
+}
+
+static void
+luz_invalidate_octree (Luz *luz)
+{
+  if (luz->octree)
+    LUZ_STAT_ADD (luz, bytes_allocated, -luz_octree_memory_usage (luz->octree));
+  luz_octree_destroy (luz->octree);
+  luz->octree = NULL;
+  luz->octree_state = LUZ_BUILD_NONE;
+}
+
+/* descends to the leaf containing pos, or to a coarser node for higher
+ * levels of detail, and interpolates its corners like lut_interpolate;
+ * positions outside the cube extrapolate from the border leaves.
+ */
+static inline void
+octree_interpolate (Luz         *luz,
+                    const float *pos,
+                    float       *coat_levels,
+                    int          level)
+{
+  LuzOctree           *tree = luz_get_octree (luz);
+  const LuzOctreeNode *node = &tree->node[0];
+  int          max_depth = LUZ_OCTREE_DEPTH - MAX (level, 0);
+  float        origin[3] = {0.0f, 0.0f, 0.0f};
+  float        size = 1.0f;
+  float        delta[3];
+  const float *coat_corner[8];
+  float        temp1[LUZ_MAX_COATS];
+  float        temp2[LUZ_MAX_COATS];
+  float        temp3[LUZ_MAX_COATS];
+  float        temp4[LUZ_MAX_COATS];
+  int          depth, i;
+
+  for (depth = 0; node->child && depth < max_depth; depth++)
+  {
+    int octant = 0;
+    size *= 0.5f;
+    for (i = 0; i < 3; i++)
+      if (pos[i] >= origin[i] + size)
+      {
+        octant |= 1 << i;
+        origin[i] += size;
+      }
+    node = &tree->node[node->child + octant];
+  }
+  for (i = 0; i < 3; i++)
+    delta[i] = (pos[i] - origin[i]) / size;
+  for (i = 0; i < 8; i++)
+    coat_corner[i] = &tree->level[node->corner[i] * tree->coats];
+  LUZ_STAT_ADD (luz, lut_lookups, 8);
+
+  lerp_coats (luz->coats, temp1, coat_corner[0], coat_corner[1], delta[0]);
+  lerp_coats (luz->coats, temp2, coat_corner[3], coat_corner[2], delta[0]);
+  lerp_coats (luz->coats, temp3, coat_corner[4], coat_corner[5], delta[0]);
+  lerp_coats (luz->coats, temp4, coat_corner[7], coat_corner[6], delta[0]);
+  lerp_coats (luz->coats, temp1, temp1, temp3, delta[1]);
+  lerp_coats (luz->coats, temp2, temp2, temp4, delta[1]);
+  lerp_coats (luz->coats, coat_levels, temp1, temp2, delta[2]);
+}
+
+/* the configured RGB table, before quantising to coat levels */
+static inline void
+table_interpolate (Luz         *luz,
+                   const float *rgb,
+                   float       *coat_levels,
+                   int          level)
+{
+  if (luz->table == LUZ_TABLE_ADAPTIVE)
+    octree_interpolate (luz, rgb, coat_levels, level);
+  else
+    lut_interpolate (luz, LUZ_SPACE_RGB, rgb, coat_levels, level);
+}
+
+/* building the RGB table up front, see luz_build_table; cells still above
+ * target_de= after their first solve are solved again from their current
+ * levels, worst first, in rounds until the budget is spent. A cell is
+ * dropped once LUZ_BUILD_ATTEMPTS solves in a row failed to bring its
+ * residual below LUZ_BUILD_PROGRESS of the best so far, further solves are
+ * unlikely to help it - typically colours outside the gamut.
+ */
+#define LUZ_BUILD_PROGRESS 0.98f
+#define LUZ_BUILD_ATTEMPTS 3
+
+typedef struct _CellResidual CellResidual;
+
+struct _CellResidual
+{
+  float   de;       /* -1 once dropped */
+  int32_t cell;
+  int32_t attempts; /* solves in a row without progress */
+};
+
+typedef struct _TableBuild TableBuild;
+
+struct _TableBuild
+{
+  CellResidual *residual; /* the cells above target, worst first */
+  int32_t       round;
+  uint64_t      deadline; /* in luz_trace_now () time */
+};
+
+static int
+cell_residual_compare (const void *a,
+                       const void *b)
+{
+  float de_a = ((const CellResidual *) a)->de;
+  float de_b = ((const CellResidual *) b)->de;
+  return de_a < de_b ? 1 : de_a > de_b ? -1 : 0;
+}
+
+static void
+table_build_solve (Luz  *luz,
+                   void *data,
+                   int   start,
+                   int   end)
+{
+  int dim = luz->lut_dim;
+  int i;
+  (void) data; /* every cell is solved once, nothing to share */
+  for (i = start; i < end; i++)
+    ensure_lut (luz, LUZ_SPACE_RGB, i / (dim * dim), i / dim % dim, i % dim);
+}
+
+static void
+table_build_refine (Luz  *luz,
+                    void *data,
+                    int   start,
+                    int   end)
+{
+  TableBuild *b = data;
+  int dim = luz->lut_dim;
+  int i;
+  for (i = start; i < end && luz_trace_now () < b->deadline; i++)
+  {
+    int      index = b->residual[i].cell;
+    InkMix  *cell = &luz->lut[index];
+    int32_t  state = LUZ_CELL_DEFINED;
+    uint32_t rng = luz_random_seed (index + (b->round + 1) * dim * dim * dim);
+    float    levels[LUZ_MAX_COATS];
+    float    rgb[3];
+    float    de;
+
+    if (!__atomic_compare_exchange_n (&cell->defined, &state, LUZ_CELL_BUSY, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+      continue;
+    LUZ_TRACE_BEGIN (luz, "refine cell", index);
+    lut_node_target (luz, LUZ_SPACE_RGB, dim,
+                     index / (dim * dim), index / dim % dim, index % dim, rgb);
+    memcpy (levels, cell->level, sizeof (float) * luz->coats);
+    _rgb_to_coats_warm (luz, rgb, NULL, levels, &rng);
+    de = cell_residual (luz, rgb, levels);
+    if (de < cell->residual)
+    {
+      memcpy (cell->level, levels, sizeof (float) * luz->coats);
+      cell->residual = de;
+    }
+    if (de < b->residual[i].de * LUZ_BUILD_PROGRESS)
+    {
+      b->residual[i].de = de;
+      b->residual[i].attempts = 0;
+    }
+    else if (++b->residual[i].attempts >= LUZ_BUILD_ATTEMPTS)
+      b->residual[i].de = -1.0f;
+    LUZ_TRACE_END (luz, "refine cell", index);
+    __atomic_store_n (&cell->defined, LUZ_CELL_DEFINED, __ATOMIC_RELEASE);
+    LUZ_STAT_ADD (luz, refine_solves, 1);
+  }
+}
+
+int
+luz_build_table (Luz *luz)
+{
+  int        dim = luz->lut_dim;
+  int        total = dim * dim * dim;
+  TableBuild b = {NULL, 0, luz_trace_now () + luz->build_seconds * 1e9};
+  int        count = 0;
+  int        i;
+
+  if (luz->table == LUZ_TABLE_ADAPTIVE)
+  {
+    luz_get_octree (luz);
+    return 0;
+  }
+
+  LUZ_TRACE_BEGIN (luz, "build table", total);
+  luz_parallel_for (luz, total, 4, table_build_solve, &b);
+
+  b.residual = malloc (sizeof (CellResidual) * total);
+  for (i = 0; i < total; i++)
+    if (luz->lut[i].residual > luz->target_de)
+      b.residual[count++] = (CellResidual){luz->lut[i].residual, i, 0};
+  while (count && luz_trace_now () < b.deadline)
+  {
+    int kept = 0;
+    qsort (b.residual, count, sizeof (CellResidual), cell_residual_compare);
+    luz_parallel_for (luz, count, 1, table_build_refine, &b);
+    for (i = 0; i < count; i++)
+      if (b.residual[i].de > luz->target_de)
+        b.residual[kept++] = b.residual[i];
+    count = kept;
+    b.round++;
+  }
+  free (b.residual);
+  LUZ_TRACE_END (luz, "build table", total);
+
+  count = 0;
+  for (i = 0; i < total; i++)
+    if (luz->lut[i].residual > luz->target_de)
+      count++;
+  return count;
+}
+
+static void luz_rgb_to_coats_direct (Luz         *luz,
+                                     const float *rgb,
+                                     float       *coat_levels);
+
+void luz_rgb_to_coats_level (Luz         *luz,
+                             const float *rgb,
+                             float       *coat_levels,
+                             int          level)
+{
+  if ((luz->direct || luz_discrete (luz)) && level <= 0)
+    luz_rgb_to_coats_direct (luz, rgb, coat_levels);
+  else
+    table_interpolate (luz, rgb, coat_levels, level);
+  quantise_coats (luz, coat_levels);
+}
+
+/* the Lab table is created by the first thread needing it */
+static InkMix *
+luz_get_lab_lut (Luz *luz)
+{
+  InkMix *lut = __atomic_load_n (&luz->lab_lut, __ATOMIC_ACQUIRE);
+  InkMix *expected = NULL;
+  size_t  size = sizeof (InkMix) * luz->lut_dim * luz->lut_dim * luz->lut_dim;
+  if (lut)
+    return lut;
+  lut = calloc (size, 1);
+  if (__atomic_compare_exchange_n (&luz->lab_lut, &expected, lut, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    LUZ_STAT_ADD (luz, bytes_allocated, size);
+    return lut;
+  }
+  free (lut);
+  return expected;
+}
+
+void luz_lab_to_coats (Luz         *luz,
+                       const float *lab,
+                       float       *coat_levels)
+{
+  float pos[3] = {lab[0] / 100.0f,
+                  (lab[1] + LAB_AB_RANGE) / (2.0f * LAB_AB_RANGE),
+                  (lab[2] + LAB_AB_RANGE) / (2.0f * LAB_AB_RANGE)};
+  int c;
+  for (c = 0; c < 3; c++)
+    pos[c] = CLAMP (pos[c], 0.0f, 1.0f);
+  luz_get_lab_lut (luz);
+  lut_interpolate (luz, LUZ_SPACE_LAB, pos, coat_levels, 0);
+  quantise_coats (luz, coat_levels);
+}
+
+void luz_xyz_to_coats (Luz         *luz,
+                       const float *xyz,
+                       float       *coat_levels)
+{
+  float lab[3];
+  xyz_to_lab (luz, xyz, lab);
+  luz_lab_to_coats (luz, lab, coat_levels);
+}
+
+void luz_rgb_to_coats (Luz  *luz, const float *rgb, float *coat_levels)
+{
+  luz_rgb_to_coats_level (luz, rgb, coat_levels, 0);
+}
+
+static LuzMemo *
+luz_memo_new (int entries)
+{
+  LuzMemo *memo = calloc (sizeof (LuzMemo), 1);
+  int capacity = (entries + LUZ_MEMO_SHARDS - 1) / LUZ_MEMO_SHARDS;
+  int i;
+  if (capacity < 1)
+    capacity = 1;
+  memo->entries = entries;
+  for (i = 0; i < LUZ_MEMO_SHARDS; i++)
+  {
+    LuzMemoShard *shard = &memo->shard[i];
+    pthread_mutex_init (&shard->mutex, NULL);
+    shard->capacity = capacity;
+    shard->bucket = malloc (sizeof (int32_t) * capacity);
+    shard->entry = malloc (sizeof (LuzMemoEntry) * capacity);
+    memset (shard->bucket, 0xff, sizeof (int32_t) * capacity);
+    shard->newest = shard->oldest = -1;
+  }
+  return memo;
+}
+
+static size_t
+luz_memo_memory_usage (LuzMemo *memo)
+{
+  if (!memo)
+    return 0;
+  return sizeof (LuzMemo) + LUZ_MEMO_SHARDS * memo->shard[0].capacity *
+                            (sizeof (int32_t) + sizeof (LuzMemoEntry));
+}
+
+static void
+luz_memo_clear (LuzMemo *memo)
+{
+  int i;
+  if (!memo)
+    return;
+  for (i = 0; i < LUZ_MEMO_SHARDS; i++)
+  {
+    LuzMemoShard *shard = &memo->shard[i];
+    pthread_mutex_lock (&shard->mutex);
+    memset (shard->bucket, 0xff, sizeof (int32_t) * shard->capacity);
+    shard->used = 0;
+    shard->newest = shard->oldest = -1;
+    pthread_mutex_unlock (&shard->mutex);
+  }
+}
+
+static void
+luz_memo_destroy (LuzMemo *memo)
+{
+  int i;
+  if (!memo)
+    return;
+  for (i = 0; i < LUZ_MEMO_SHARDS; i++)
+  {
+    pthread_mutex_destroy (&memo->shard[i].mutex);
+    free (memo->shard[i].bucket);
+    free (memo->shard[i].entry);
+  }
+  free (memo);
+}
+
+/* the memo is created by the first thread needing it */
+static LuzMemo *
+luz_get_memo (Luz *luz)
+{
+  LuzMemo *memo = __atomic_load_n (&luz->memo, __ATOMIC_ACQUIRE);
+  LuzMemo *expected = NULL;
+  if (memo)
+    return memo;
+  memo = luz_memo_new (luz->memo_size);
+  if (__atomic_compare_exchange_n (&luz->memo, &expected, memo, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    LUZ_STAT_ADD (luz, bytes_allocated, luz_memo_memory_usage (memo));
+    return memo;
+  }
+  luz_memo_destroy (memo);
+  return expected;
+}
+
+static inline uint64_t
+luz_memo_hash (const uint16_t *key)
+{
+  uint64_t hash = 14695981039346656037ull; /* FNV-1a */
+  int i;
+  for (i = 0; i < LUZ_MEMO_KEY; i++)
+  {
+    hash ^= key[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static inline void
+luz_memo_unlink (LuzMemoShard *shard,
+                 int32_t       e)
+{
+  LuzMemoEntry *entry = &shard->entry[e];
+  if (entry->newer >= 0)
+    shard->entry[entry->newer].older = entry->older;
+  else
+    shard->newest = entry->older;
+  if (entry->older >= 0)
+    shard->entry[entry->older].newer = entry->newer;
+  else
+    shard->oldest = entry->newer;
+}
+
+static inline void
+luz_memo_push (LuzMemoShard *shard,
+               int32_t       e)
+{
+  LuzMemoEntry *entry = &shard->entry[e];
+  entry->newer = -1;
+  entry->older = shard->newest;
+  if (shard->newest >= 0)
+    shard->entry[shard->newest].newer = e;
+  shard->newest = e;
+  if (shard->oldest < 0)
+    shard->oldest = e;
+}
+
+/* returns 1 and the memoised levels if key is present */
+static int
+luz_memo_lookup (Luz            *luz,
+                 LuzMemo        *memo,
+                 const uint16_t *key,
+                 float          *coat_levels)
+{
+  uint64_t      hash = luz_memo_hash (key);
+  LuzMemoShard *shard = &memo->shard[hash % LUZ_MEMO_SHARDS];
+  int32_t       e;
+
+  LUZ_STAT_ADD (luz, memo_lookups, 1);
+  pthread_mutex_lock (&shard->mutex);
+  for (e = shard->bucket[(hash / LUZ_MEMO_SHARDS) % shard->capacity];
+       e >= 0; e = shard->entry[e].chain)
+    if (!memcmp (shard->entry[e].key, key, sizeof (uint16_t) * LUZ_MEMO_KEY))
+    {
+      memcpy (coat_levels, shard->entry[e].level, sizeof (float) * luz->coats);
+      luz_memo_unlink (shard, e);
+      luz_memo_push (shard, e);
+      pthread_mutex_unlock (&shard->mutex);
+      LUZ_STAT_ADD (luz, memo_hits, 1);
+      return 1;
+    }
+  pthread_mutex_unlock (&shard->mutex);
+  return 0;
+}
+
+static void
+luz_memo_insert (Luz            *luz,
+                 LuzMemo        *memo,
+                 const uint16_t *key,
+                 const float    *coat_levels)
+{
+  uint64_t      hash = luz_memo_hash (key);
+  LuzMemoShard *shard = &memo->shard[hash % LUZ_MEMO_SHARDS];
+  int32_t      *head;
+  int32_t       e;
+
+  pthread_mutex_lock (&shard->mutex);
+  head = &shard->bucket[(hash / LUZ_MEMO_SHARDS) % shard->capacity];
+  for (e = *head; e >= 0; e = shard->entry[e].chain)
+    if (!memcmp (shard->entry[e].key, key, sizeof (uint16_t) * LUZ_MEMO_KEY))
+    { /* solved by another thread meanwhile */
+      pthread_mutex_unlock (&shard->mutex);
+      return;
+    }
+
+  if (shard->used < shard->capacity)
+    e = shard->used++;
+  else
+  { /* recycle the least recently used entry */
+    LuzMemoEntry *old;
+    int32_t      *link;
+    e = shard->oldest;
+    old = &shard->entry[e];
+    luz_memo_unlink (shard, e);
+    for (link = &shard->bucket[(luz_memo_hash (old->key) / LUZ_MEMO_SHARDS) %
+                               shard->capacity];
+         *link != e; link = &shard->entry[*link].chain);
+    *link = old->chain;
+  }
+  memcpy (shard->entry[e].key, key, sizeof (uint16_t) * LUZ_MEMO_KEY);
+  memcpy (shard->entry[e].level, coat_levels, sizeof (float) * luz->coats);
+  shard->entry[e].chain = *head;
+  *head = e;
+  luz_memo_push (shard, e);
+  pthread_mutex_unlock (&shard->mutex);
+}
+
+/* spectral targets are keyed by their bands quantised to 1/256, the target
+ * solved for is rebuilt from the key - so results do not depend on which of
+ * the spectra sharing a key is solved first. Coarser projections, like the
+ * means of groups of bands, lose too much for sharply featured spectra.
+ */
+static inline void
+spectrum_memo_key (const float *reflectance,
+                   uint16_t    *key)
+{
+  int i;
+  key[0] = LUZ_MEMO_SPECTRUM;
+  for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
+    key[1 + i] = CLAMP (reflectance[i] * 256.0f + 0.5f, 0.0f, 65535.0f);
+}
+
+static inline void
+spectrum_from_memo_key (const uint16_t *key,
+                        Spectrum       *reflectance)
+{
+  int i;
+  for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
+    reflectance->bands[i] = key[1 + i] / 256.0f;
+}
+
+/* direct solve for a reflectance, warm started from the separation table
+ * entry of its RGB and refined against the spectrum under the illuminant.
+ */
+static void
+spectrum_solve (Luz            *luz,
+                const Spectrum *reflectance,
+                float          *coat_levels,
+                uint32_t       *rng)
+{
+  Spectrum target;
+  float rgb[3];
+  int c;
+
+  spectrum_scale (&target, reflectance, &luz->illuminant);
+  spectrum_to_rgb (luz, &target, rgb);
+  for (c = 0; c < 3; c++)
+    rgb[c] = CLAMP (rgb[c], 0.0f, 1.0f);
+  table_interpolate (luz, rgb, coat_levels, 0);
+  _rgb_to_coats_warm (luz, rgb, &target, coat_levels, rng);
+}
+
+void
+luz_spectrum_to_coats (Luz         *luz,
+                       const float *reflectance,
+                       float       *coat_levels,
+                       int          count)
+{
+  LuzMemo *memo = luz_get_memo (luz);
+  uint16_t prev_key[LUZ_MEMO_KEY] = {0,};
+  int n;
+
+  for (n = 0; n < count; n++)
+  {
+    uint16_t key[LUZ_MEMO_KEY];
+    float   *levels = coat_levels + n * luz->coats;
+
+    spectrum_memo_key (reflectance + n * LUZ_SPECTRUM_BANDS, key);
+
+    /* runs of identical pixels skip the memo */
+    if (n > 0 && !memcmp (key, prev_key, sizeof (key)))
+    {
+      memcpy (levels, levels - luz->coats, sizeof (float) * luz->coats);
+      continue;
+    }
+    memcpy (prev_key, key, sizeof (key));
+
+    if (!luz_memo_lookup (luz, memo, key, levels))
+    {
+      Spectrum target;
+      uint32_t rng = luz_random_seed (luz_memo_hash (key));
+      spectrum_from_memo_key (key, &target);
+      LUZ_TRACE_BEGIN (luz, "solve spectrum", -1);
+      spectrum_solve (luz, &target, levels, &rng);
+      LUZ_TRACE_END (luz, "solve spectrum", -1);
+      luz_memo_insert (luz, memo, key, levels);
+    }
+  }
+}
+
+/* direct=1 solves each distinct colour rather than interpolating the table,
+ * which can blend solutions from different minima. Colours are keyed to
+ * 1/4096, over -4.0 to 12.0, and like spectra solved for the colour rebuilt
+ * from the key, warm started from the table.
+ */
+#define LUZ_MEMO_RGB_SCALE 4096.0f
+#define LUZ_MEMO_RGB_BIAS  16384
+
+static inline void
+rgb_memo_key (const float *rgb,
+              uint16_t    *key)
+{
+  int c;
+  memset (key, 0, sizeof (uint16_t) * LUZ_MEMO_KEY);
+  key[0] = LUZ_MEMO_RGB;
+  for (c = 0; c < 3; c++)
+    key[1 + c] = CLAMP (rgb[c] * LUZ_MEMO_RGB_SCALE + LUZ_MEMO_RGB_BIAS + 0.5f,
+                        0.0f, 65535.0f);
+}
+
+static void
+luz_rgb_to_coats_direct (Luz         *luz,
+                         const float *rgb,
+                         float       *coat_levels)
+{
+  LuzMemo *memo = luz_get_memo (luz);
+  uint16_t key[LUZ_MEMO_KEY];
+
+  rgb_memo_key (rgb, key);
+  if (!luz_memo_lookup (luz, memo, key, coat_levels))
+  {
+    uint32_t rng = luz_random_seed (luz_memo_hash (key));
+    float    target[3];
+    int      c;
+    for (c = 0; c < 3; c++)
+      target[c] = (key[1 + c] - LUZ_MEMO_RGB_BIAS) / LUZ_MEMO_RGB_SCALE;
+    LUZ_TRACE_BEGIN (luz, "solve direct", -1);
+    if (luz_discrete (luz))
+      memset (coat_levels, 0, sizeof (float) * luz->coats);
+    else
+      table_interpolate (luz, target, coat_levels, 0);
+    _rgb_to_coats_warm (luz, target, NULL, coat_levels, &rng);
+    LUZ_TRACE_END (luz, "solve direct", -1);
+    luz_memo_insert (luz, memo, key, coat_levels);
+  }
+}
+
+void
+luz_spectrum_resample (const float *src,
+                       int          src_bands,
+                       float        src_start,
+                       float        src_gap,
+                       float       *reflectance)
+{
+  int i;
+  for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
+  {
+    float nm = LUZ_SPECTRUM_START + i * LUZ_SPECTRUM_GAP;
+    float pos = (nm - src_start) / src_gap;
+    int   p0 = floorf (pos);
+    if (src_bands < 2 || p0 < 0)
+      reflectance[i] = src[0];
+    else if (p0 >= src_bands - 1)
+      reflectance[i] = src[src_bands - 1];
+    else
+      reflectance[i] = LERP (src[p0], src[p0 + 1], pos - p0);
+  }
+}
+
+/* the rgb keyword of configurations; a mix of the red, green and blue
+ * spectra, which configurations can redefine, giving coats the box like
+ * spectra of such a basis. Colours given to luz_rgb_to_spectrum and
+ * luz_rgb_to_reflectance get smooth reflectances, see LuzUpsample.
+ */
+static Spectrum _rgb_to_spectrum (Luz *luz, float r, float g, float b)
+{
+  Spectrum s;
+  int i;
+  Spectrum red   = *luz_get_spectrum (luz, "red");
+  Spectrum green = *luz_get_spectrum (luz, "green");
+  Spectrum blue  = *luz_get_spectrum (luz, "blue");
+
+  for (i = 0; i<LUZ_SPECTRUM_BANDS; i++)
+    s.bands[i] = red.bands[i] * powf(r,2.2) + green.bands[i] * powf(g,2.2) + blue.bands[i] * powf(b, 2.2);
+  return s;
+}
+
+/* smooth reflectances, see LuzUpsample */
+
+/* 1 / sqrt (x) for x of 1.0 and up, a bit level first guess refined by
+ * two Newton iterations; unlike sqrtf it lets the band loops vectorize
+ */
+static inline float
+fast_rsqrtf (float x)
+{
+  union { float f; uint32_t i; } u = {x};
+  float y;
+  u.i = 0x5f375a86 - (u.i >> 1);
+  y = u.f;
+  y = y * (1.5f - 0.5f * x * y * y);
+  return y * (1.5f - 0.5f * x * y * y);
+}
+
+static inline float
+upsample_sigmoid (float x)
+{
+  return 0.5f + 0.5f * x * fast_rsqrtf (1.0f + x * x);
+}
+
+static inline void
+upsample_reflectance (const float *coeffs,
+                      float       *reflectance)
+{
+  int i;
+  for (i = 0; i < LUZ_SPECTRUM_BANDS; i++)
+  {
+    float t = i / (LUZ_SPECTRUM_BANDS - 1.0f);
+    reflectance[i] = upsample_sigmoid ((coeffs[0] * t + coeffs[1]) * t +
+                                       coeffs[2]);
+  }
+}
+
+static float
+upsample_diff (Luz         *luz,
+               const float *target,
+               const float *coeffs,
+               float       *residual)
+{
+  Spectrum reflectance;
+  float    xyz[3], lab[3];
+  int      c;
+  upsample_reflectance (coeffs, reflectance.bands);
+  reflectance_to_xyz (&luz->lit, &reflectance, xyz);
+  xyz_to_lab (luz, xyz, lab);
+  for (c = 0; c < 3; c++)
+    residual[c] = target[c] - lab[c];
+  return residual[0] * residual[0] + residual[1] * residual[1] +
+         residual[2] * residual[2];
+}
 
-  do
-  {
-    int j;
-    float softrgb[4];
-    float diff;
-    float coatsum = 0;
+/* Gauss-Newton on the Lab difference, with a numeric Jacobian, starting
+ * from the coefficients passed in; steps that do not reduce the difference
+ * are halved.
+ */
+static void
+upsample_fit (Luz         *luz,
+              const float *rgb,
+              float       *coeffs)
+{
+  float xyz[3], target[3], residual[3];
+  float diff;
+  int   iteration, c, k;
 
+  rgb_to_xyz (rgb, xyz);
+  xyz_to_lab (luz, xyz, target);
+  diff = upsample_diff (luz, target, coeffs, residual);
 
-    coatsum = 0.0;
-    for (j = 0; j < luz->coats; j++)
+  for (iteration = 0; iteration < LUZ_UPSAMPLE_ITERATIONS && diff > 1e-6f;
+       iteration++)
+  {
+    float jacobian[3][3], step[3], det, scale;
+    for (k = 0; k < 3; k++)
     {
-      coatsum += attempt[j];
+      float moved[3] = {coeffs[0], coeffs[1], coeffs[2]};
+      float moved_residual[3];
+      moved[k] += 1e-3f;
+      upsample_diff (luz, target, moved, moved_residual);
+      for (c = 0; c < 3; c++)
+        jacobian[c][k] = (residual[c] - moved_residual[c]) / 1e-3f;
     }
 
-    if (coatsum <= luz->coverage_limit)
-    {
-      if (spectrum)
-      {
-        Spectrum soft_spec = luz_coats_to_spectrum (luz, attempt);
-        diff = spec_diff_squared (&spectrum->bands[0],
-                                  &soft_spec.bands[0],
-                                  LUZ_SPECTRUM_BANDS);
-      }
-      else
-      {
-        luz_coats_to_rgb (luz, attempt, softrgb);
-        //diff = colordiff (rgb, softrgb) * coatsum;// + (coatsum / luz->coats / 200);
-        diff = spec_diff_squared (rgb, softrgb, 3);
-      }
+#define DET3(m) (m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - \
+                 m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) + \
+                 m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]))
+    det = DET3 (jacobian);
+    if (fabsf (det) < 1e-12f)
+      break;
+    for (k = 0; k < 3; k++)
+    { /* Cramer's rule */
+      float m[3][3];
+      memcpy (m, jacobian, sizeof (m));
+      for (c = 0; c < 3; c++)
+        m[c][k] = residual[c];
+      step[k] = DET3 (m) / det;
+    }
+#undef DET3
 
-    if (diff < bestdiff)
+    for (scale = 1.0f; scale > 1.0f / 256; scale *= 0.5f)
     {
-      bestdiff = diff;
-      for (j = 0; j < luz->coats; j++)
+      float next[3], next_residual[3], next_diff;
+      for (k = 0; k < 3; k++)
+        next[k] = coeffs[k] + step[k] * scale;
+      next_diff = upsample_diff (luz, target, next, next_residual);
+      if (next_diff < diff)
       {
-        prev_best[j] = best[j];
-        best[j] = attempt[j];
-      }
-      if (diff < 0.0001) /* close enough */
+        memcpy (coeffs, next, sizeof (next));
+        memcpy (residual, next_residual, sizeof (next_residual));
+        diff = next_diff;
         break;
+      }
     }
-    }
+    if (scale <= 1.0f / 256)
+      break;
+  }
+}
 
-    /* update exhaustive attempts */
-    attempt[luz->coats-1] += INCREMENT;
-    for (int j = luz->coats-1; j>0;j--)
+/* fits the nodes of a column of the table, of one largest channel and
+ * relative values of the others, from the middle value out, each node
+ * starting from the coefficients of its neighbour.
+ */
+static void
+upsample_fit_columns (Luz  *luz,
+                      void *data,
+                      int   start,
+                      int   end)
+{
+  LuzUpsample *u = data;
+  int i;
+  for (i = start; i < end; i++)
+  {
+    int   largest = i / (LUZ_UPSAMPLE_RES * LUZ_UPSAMPLE_RES);
+    int   yi = i / LUZ_UPSAMPLE_RES % LUZ_UPSAMPLE_RES;
+    int   xi = i % LUZ_UPSAMPLE_RES;
+    int   middle = LUZ_UPSAMPLE_RES / 2;
+    float coeffs[3] = {0.0f, 0.0f, 0.0f};
+    int   dir;
+    for (dir = 1; dir >= -1; dir -= 2)
     {
-      if (attempt[j]>1.0)
+      int zi;
+      if (dir < 0)
+        memcpy (coeffs, u->coeffs[largest][middle][yi][xi], sizeof (coeffs));
+      for (zi = dir > 0 ? middle : middle - 1;
+           zi >= 0 && zi < LUZ_UPSAMPLE_RES; zi += dir)
       {
-        attempt[j] = 0;
-        attempt[j-1] += INCREMENT;
+        float z = u->scale[zi];
+        float rgb[3];
+        rgb[largest] = z;
+        rgb[(largest + 1) % 3] = z * xi / (LUZ_UPSAMPLE_RES - 1);
+        rgb[(largest + 2) % 3] = z * yi / (LUZ_UPSAMPLE_RES - 1);
+        upsample_fit (luz, rgb, coeffs);
+        memcpy (u->coeffs[largest][zi][yi][xi], coeffs, sizeof (coeffs));
       }
-
     }
-
-  } while (attempt[0] <= 1.0 && luz->coats > 0);
-
-  for (i = 0; i < luz->coats; i++)
-    coat_levels[i] = best[i];
+  }
 }
 
-static inline void _rgb_to_coats (Luz  *luz, const float *rgb, Spectrum *spectrum, float *coat_levels)
+static LuzUpsample *
+luz_upsample_new (Luz *luz)
 {
-  luz_rgb_to_coats_griddy (luz, rgb, spectrum, coat_levels);
-  luz_rgb_to_coats_stochastic (luz, rgb, spectrum, coat_levels,
-                               luz->STOCHASTIC_ITERATIONS,
-                               luz->STOCHASTIC_DIFFUSION0,
-                               luz->STOCHASTIC_DIFFUSION1);
+  LuzUpsample *u = malloc (sizeof (LuzUpsample));
+  int i;
+  for (i = 0; i < LUZ_UPSAMPLE_RES; i++)
+  { /* smoothstep twice */
+    float t = i / (LUZ_UPSAMPLE_RES - 1.0f);
+    t = t * t * (3.0f - 2.0f * t);
+    u->scale[i] = t * t * (3.0f - 2.0f * t);
+  }
+  luz_parallel_for (luz, 3 * LUZ_UPSAMPLE_RES * LUZ_UPSAMPLE_RES, 8,
+                    upsample_fit_columns, u);
+  return u;
 }
 
-static inline float *
-ensure_lut (Luz *luz,
-            int    ri,
-            int    gi,
-            int    bi)
+/* the table is fitted by the first thread needing it, others wait */
+static LuzUpsample *
+luz_get_upsample (Luz *luz)
 {
-  int l_index;
-  l_index = lut_index (ri, gi, bi);
-  if (!luz->lut[l_index].defined)
+  int32_t state = __atomic_load_n (&luz->upsample_state, __ATOMIC_ACQUIRE);
+  if (state == LUZ_BUILD_READY)
+    return luz->upsample;
+  if (state == LUZ_BUILD_NONE &&
+      __atomic_compare_exchange_n (&luz->upsample_state, &state,
+                                   LUZ_BUILD_BUSY, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
   {
-    float trgb[3] = {(float)ri / LUT_DIM,
-                     (float)gi / LUT_DIM,
-                     (float)bi / LUT_DIM };
-    luz->lut[l_index].defined = 2;
-    _rgb_to_coats (luz, trgb, NULL, &luz->lut[l_index].level[0]);
-    luz->lut[l_index].defined = 1;
+    LUZ_TRACE_BEGIN (luz, "build upsample", -1);
+    luz->upsample = luz_upsample_new (luz);
+    LUZ_STAT_ADD (luz, bytes_allocated, sizeof (LuzUpsample));
+    LUZ_TRACE_END (luz, "build upsample", -1);
+    __atomic_store_n (&luz->upsample_state, LUZ_BUILD_READY, __ATOMIC_RELEASE);
+    return luz->upsample;
   }
+  LUZ_TRACE_BEGIN (luz, "wait upsample", -1);
+  while (__atomic_load_n (&luz->upsample_state, __ATOMIC_ACQUIRE) != LUZ_BUILD_READY)
+    usleep (100);
+  LUZ_TRACE_END (luz, "wait upsample", -1);
+  return luz->upsample;
+}
 
-  while (luz->lut[l_index].defined == 2)
-    usleep (3000); // another thread is computing it, sleep
-  return &luz->lut[l_index].level[0];
+static void
+luz_invalidate_upsample (Luz *luz)
+{
+  if (luz->upsample)
+    LUZ_STAT_ADD (luz, bytes_allocated, -sizeof (LuzUpsample));
+  free (luz->upsample);
+  luz->upsample = NULL;
+  luz->upsample_state = LUZ_BUILD_NONE;
 }
 
+/* the coefficients for a linear RGB colour, clamped to 0.0 - 1.0,
+ * interpolated between the nodes around it */
 static inline void
-lerp_coats (int          coats,
-                float       *coat_res,
-                const float *coata,
-                const float *coatb,
-                float        delta)
+upsample_coeffs (const LuzUpsample *u,
+                 const float       *rgb,
+                 float             *coeffs)
 {
-  int i;
-  for (i = 0; i < coats; i++)
-    coat_res[i] = coata[i]  * (1.0 - delta) + coatb[i] * delta;
+  float v[3] = {CLAMP (rgb[0], 0.0f, 1.0f),
+                CLAMP (rgb[1], 0.0f, 1.0f),
+                CLAMP (rgb[2], 0.0f, 1.0f)};
+  int   largest = v[0] >= v[1] ? (v[0] >= v[2] ? 0 : 2) : (v[1] >= v[2] ? 1 : 2);
+  float z = v[largest];
+  float x = z > 0.0f ? v[(largest + 1) % 3] / z : 0.0f;
+  float y = z > 0.0f ? v[(largest + 2) % 3] / z : 0.0f;
+  int   lo = 0, hi = LUZ_UPSAMPLE_RES - 1;
+  int   xi, yi, zi, c;
+  float dx, dy, dz;
+
+  while (hi - lo > 1)
+  {
+    int mid = (lo + hi) / 2;
+    if (u->scale[mid] <= z)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  zi = lo;
+  dz = (z - u->scale[zi]) / (u->scale[zi + 1] - u->scale[zi]);
+  x *= LUZ_UPSAMPLE_RES - 1;
+  y *= LUZ_UPSAMPLE_RES - 1;
+  xi = MIN ((int) x, LUZ_UPSAMPLE_RES - 2);
+  yi = MIN ((int) y, LUZ_UPSAMPLE_RES - 2);
+  dx = x - xi;
+  dy = y - yi;
+
+  for (c = 0; c < 3; c++)
+  {
+    const float (*n)[LUZ_UPSAMPLE_RES][LUZ_UPSAMPLE_RES][3] =
+      u->coeffs[largest];
+    float a = LERP (LERP (n[zi][yi][xi][c],     n[zi][yi][xi + 1][c],     dx),
+                    LERP (n[zi][yi + 1][xi][c], n[zi][yi + 1][xi + 1][c], dx),
+                    dy);
+    float b = LERP (LERP (n[zi + 1][yi][xi][c],     n[zi + 1][yi][xi + 1][c],     dx),
+                    LERP (n[zi + 1][yi + 1][xi][c], n[zi + 1][yi + 1][xi + 1][c], dx),
+                    dy);
+    coeffs[c] = LERP (a, b, dz);
+  }
 }
 
-void luz_rgb_to_coats (Luz  *luz, const float *rgb, float *coat_levels)
+void
+luz_rgb_to_reflectance (Luz         *luz,
+                        const float *rgb,
+                        float       *reflectance,
+                        int          count)
 {
-  float rdelta, gdelta, bdelta;
-  int ri = lut_indice (rgb[0], &rdelta);
-  int gi = lut_indice (rgb[1], &gdelta);
-  int bi = lut_indice (rgb[2], &bdelta);
-  float *coat_corner[8];
-  float  temp1[LUZ_MAX_COATS];
-  float  temp2[LUZ_MAX_COATS];
-  float  temp3[LUZ_MAX_COATS];
-  float  temp4[LUZ_MAX_COATS];
-
-/* numbering of corners, and positions of R,G,B axes
-      6
-      /\
-    /   \
- 7/   d  \5
-  |\     /|
-  |  \4/  |
- 3\B G|2  |
-   \  |  /1
-     \|/R
-      0       */
-
-  coat_corner[0] = ensure_lut (luz, ri + 0, gi + 0, bi + 0);
-  coat_corner[1] = ensure_lut (luz, ri + 1, gi + 0, bi + 0);
-  coat_corner[2] = ensure_lut (luz, ri + 1, gi + 0, bi + 1);
-  coat_corner[3] = ensure_lut (luz, ri + 0, gi + 0, bi + 1);
-
-  coat_corner[4] = ensure_lut (luz, ri + 0, gi + 1, bi + 0);
-  coat_corner[5] = ensure_lut (luz, ri + 1, gi + 1, bi + 0);
-  coat_corner[6] = ensure_lut (luz, ri + 1, gi + 1, bi + 1);
-  coat_corner[7] = ensure_lut (luz, ri + 0, gi + 1, bi + 1);
-
-  lerp_coats (luz->coats, temp1, coat_corner[0], coat_corner[1], rdelta);
-  lerp_coats (luz->coats, temp2, coat_corner[3], coat_corner[2], rdelta);
-  lerp_coats (luz->coats, temp3, coat_corner[4], coat_corner[5], rdelta);
-  lerp_coats (luz->coats, temp4, coat_corner[7], coat_corner[6], rdelta);
-  lerp_coats (luz->coats, temp1, temp1, temp3, gdelta);
-  lerp_coats (luz->coats, temp2, temp2, temp4, gdelta);
-  lerp_coats (luz->coats, coat_levels, temp1, temp2, bdelta);
+  const LuzUpsample *u = luz_get_upsample (luz);
+  int i, c, l, band;
 
-  if(1){
-    int i;
-    for (i = 0; i < luz->coats; i++)
+  /* LUZ_LANES colours at a time, with the colours as the innermost
+     dimension so the per band work vectorizes */
+  for (i = 0; i < count; i += LUZ_LANES)
+  {
+    float coeffs[3][LUZ_LANES] = {{0.0f,},};
+    int   lanes = MIN (LUZ_LANES, count - i);
+    for (l = 0; l < lanes; l++)
     {
-      int levels = luz->coat_def[i].levels;
-      if (levels > 1)
-        coat_levels[i] =
-        (((int)(coat_levels[i] * levels)%(levels)) ) / (levels-1.000f);
+      float lane_coeffs[3];
+      upsample_coeffs (u, rgb + (i + l) * 3, lane_coeffs);
+      for (c = 0; c < 3; c++)
+        coeffs[c][l] = lane_coeffs[c];
+    }
+    for (band = 0; band < LUZ_SPECTRUM_BANDS; band++)
+    {
+      float t = band / (LUZ_SPECTRUM_BANDS - 1.0f);
+      float value[LUZ_LANES];
+      for (l = 0; l < LUZ_LANES; l++)
+        value[l] = upsample_sigmoid ((coeffs[0][l] * t + coeffs[1][l]) * t +
+                                     coeffs[2][l]);
+      for (l = 0; l < lanes; l++)
+        reflectance[(i + l) * LUZ_SPECTRUM_BANDS + band] = value[l];
     }
   }
 }
 
-/* FIXME: this can be improved to gain smoother spectrums by creating or
-          finding some other basis functions. One can even have multiple
-          different basises if some types are closer to some color mixing
-          than others. */
-static Spectrum _rgb_to_spectrum (Luz *luz, float r, float g, float b)
-{
-  Spectrum s;
-  int i;
-  Spectrum red   = *luz_get_spectrum (luz, "red");
-  Spectrum green = *luz_get_spectrum (luz, "green");
-  Spectrum blue  = *luz_get_spectrum (luz, "blue");
-
-  for (i = 0; i<LUZ_SPECTRUM_BANDS; i++)
-    s.bands[i] = red.bands[i] * powf(r,2.2) + green.bands[i] * powf(g,2.2) + blue.bands[i] * powf(b, 2.2);
-  return s;
-}
-
 Spectrum
 luz_rgb_to_spectrum (Luz *luz, float r, float g, float b)
 {
-  return _rgb_to_spectrum (luz, r, g, b);
+  float    rgb[3] = {powf (r, 2.2f), powf (g, 2.2f), powf (b, 2.2f)};
+  Spectrum s;
+  luz_rgb_to_reflectance (luz, rgb, s.bands, 1);
+  return s;
 }
 
 Spectrum
@@ -711,7 +4530,7 @@ luz_parse_spectrum (Luz *luz, char *spectrum)
     band = 0;
     do {
       num_array[band++] = strtod (spectrum, &spectrum);
-    } while (spectrum && band <= 100);
+    } while (spectrum && band < 100);
 
     if (band > 3)
     {
@@ -765,12 +4584,30 @@ const Spectrum *luz_get_spectrum (Luz *luz, const char *name)
   return NULL;
 }
 
-void luz_set_spectrum (Luz *luz, const char *name, Spectrum *spectrum)
+static void
+luz_invalidate (Luz      *luz,
+                LuzDirty  dirt);
+
+/* the instance no longer is what its configuration string describes, the
+ * next luz_set_config is parsed even when given the same string, and the
+ * cache does not hand the instance out for it
+ */
+static void
+luz_forget_config (Luz *luz)
+{
+  free (luz->src);
+  luz->src = NULL;
+}
+
+/* stores a spectrum, while parsing a configuration into a fresh instance */
+static void _luz_set_spectrum (Luz *luz, const char *name, Spectrum *spectrum)
 {
   int i;
 
   if (!strcmp (name, "illuminant")) { luz->illuminant = *spectrum;
   luz->rev_y_scale = illuminant_to_rev_y_scale (luz, spectrum);
+  spectrum_to_xyz (luz, spectrum, &luz->white_xyz[0], &luz->white_xyz[1],
+                                  &luz->white_xyz[2]);
           return; }
   if (!strcmp (name, "substrate"))  { luz->substrate  = *spectrum; return; }
   if (!strcmp (name, "observer_x")) { luz->STANDARD_OBSERVER_X = *spectrum; return; }
@@ -781,58 +4618,224 @@ void luz_set_spectrum (Luz *luz, const char *name, Spectrum *spectrum)
   {
     if (!strcmp (name, luz->db.name[i]))
     {
-      luz->db.spectrum[i] = *spectrum;
+      luz->db.spectrum[i] = *spectrum;
+      return;
+    }
+  }
+  if (luz->db.count >= SPECTRUM_DB_SIZE-1)
+  {
+    /* eeek */
+    return;
+  }
+  i = luz->db.count;
+  strncpy (luz->db.name[i], name, 32);
+  luz->db.spectrum[i] = *spectrum;
+  luz->db.count++;
+}
+
+void luz_set_spectrum (Luz *luz, const char *name, Spectrum *spectrum)
+{
+  _luz_set_spectrum (luz, name, spectrum);
+  luz_forget_config (luz);
+  luz_update_proof_illuminants (luz);
+  if (!strcmp (name, "illuminant") || !strcmp (name, "substrate") ||
+      !strncmp (name, "observer_", 9))
+  { /* solutions are kept as starting points, as when reconfigured */
+    luz_invalidate (luz, LUZ_DIRTY_WARM);
+    luz_invalidate_upsample (luz);
+  }
+}
+
+static void parse_config_line (Luz   *luz,
+                               const char *line)
+{
+  char *key;
+  char *p;
+  char *rest;
+  Spectrum s;
+  int i;
+  if (!line)
+    return;
+
+  if (!strchr (line, '=')) /* lines without = are simply skipped */
+    return;
+  while (*line == ' ') line++;
+
+  key = strdup (line);
+  p = rest = strchr (key, '=');
+
+  while (*rest == '=' || *rest == ' ')
+          rest++;
+  while (*p == '=' || *p == ' ')
+  {
+    *p = '\0';
+    p--;
+  }
+
+  if (!strcmp (key, "coatlimit"))
+    {
+      luz->coverage_limit = strchr(line, '=') ? strtod (strchr (line, '=')+1, NULL) : 3.0;
+      if (luz->coverage_limit < 0.2)
+        luz->coverage_limit = 0.2;
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "debugwidth"))
+    {
+      luz->debug_width= strchr(line, '=') ? strtod (strchr (line, '=')+1, NULL) : 25;
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "trace"))
+    {
+      while (*rest == ' ') rest++;
+      strncpy (luz->trace_path, rest, sizeof (luz->trace_path) - 1);
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "proof_illuminants"))
+    {
+      strncpy (luz->proof_illuminant_names, rest,
+               sizeof (luz->proof_illuminant_names) - 1);
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "objective"))
+    {
+      while (*rest == ' ') rest++;
+      if (!strncmp (rest, "de2000", 6))
+        luz->objective = LUZ_OBJECTIVE_DE2000;
+      else if (!strncmp (rest, "de76", 4))
+        luz->objective = LUZ_OBJECTIVE_DE76;
+      else
+        luz->objective = LUZ_OBJECTIVE_RGB;
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "solver"))
+    {
+      while (*rest == ' ') rest++;
+      luz->solver = !strncmp (rest, "population", 10) || !strncmp (rest, "de", 2) ?
+                      LUZ_SOLVER_POPULATION : LUZ_SOLVER_WALK;
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "population"))
+    {
+      luz->population = CLAMP (atoi (rest), 4, LUZ_LANES);
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "generations"))
+    {
+      luz->generations = MAX (0, atoi (rest));
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "direct"))
+    {
+      luz->direct = atoi (rest) != 0;
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "table"))
+    {
+      while (*rest == ' ') rest++;
+      luz->table = !strncmp (rest, "adaptive", 8) ? LUZ_TABLE_ADAPTIVE :
+                                                    LUZ_TABLE_UNIFORM;
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "subsets"))
+    {
+      while (*rest == ' ') rest++;
+      luz->subsets = !strncmp (rest, "auto", 4) ? -1 : atoi (rest) != 0;
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "black_coat"))
+    {
+      luz->black = atoi (rest) - 1;
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "black_generation"))
+    {
+      while (*rest == ' ') rest++;
+      luz->black_generation = !strncmp (rest, "ucr", 3) ? LUZ_BLACK_UCR :
+                                                          LUZ_BLACK_GCR;
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "black_amount"))
+    {
+      luz->black_amount = CLAMP (strtod (rest, NULL), 0.0, 1.0);
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "black_start"))
+    {
+      luz->black_start = CLAMP (strtod (rest, NULL), 0.0, 1.0);
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "gamutmap"))
+    {
+      while (*rest == ' ') rest++;
+      luz->gamut_map = !strncmp (rest, "compress", 8) ? LUZ_GAMUT_MAP_COMPRESS :
+                       !strncmp (rest, "clip", 4) ? LUZ_GAMUT_MAP_CLIP :
+                                                    LUZ_GAMUT_MAP_NONE;
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "target_de"))
+    {
+      luz->target_de = MAX (0.0, strtod (rest, NULL));
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "build_seconds"))
+    {
+      luz->build_seconds = MAX (0.0, strtod (rest, NULL));
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "refine"))
+    {
+      luz->refine = MAX (0.0, strtod (rest, NULL));
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "table_nodes"))
+    {
+      luz->table_nodes = CLAMP (atoi (rest), 125,
+                                LUZ_OCTREE_SIDE * LUZ_OCTREE_SIDE * LUZ_OCTREE_SIDE);
+      free (key);
+      return;
+    }
+  else if (!strcmp (key, "seeds"))
+    {
+      while (*rest == ' ') rest++;
+      luz->seed_count = !strncmp (rest, "auto", 4) ? -1 :
+                        CLAMP (atoi (rest), 0, LUZ_SEEDS_K_MAX);
+      free (key);
       return;
     }
-  }
-  if (luz->db.count >= SPECTRUM_DB_SIZE-1)
-  {
-    /* eeek */
-    return;
-  }
-  i = luz->db.count;
-  strncpy (luz->db.name[i], name, 32);
-  luz->db.spectrum[i] = *spectrum;
-  luz->db.count++;
-}
-
-static void parse_config_line (Luz   *luz,
-                               const char *line)
-{
-  char *key;
-  char *p;
-  char *rest;
-  Spectrum s;
-  int i;
-  if (!line)
-    return;
-
-  if (!strchr (line, '=')) /* lines without = are simply skipped */
-    return;
-  while (*line == ' ') line++;
-
-  key = strdup (line);
-  p = rest = strchr (key, '=');
-
-  while (*rest == '=' || *rest == ' ')
-          rest++;
-  while (*p == '=' || *p == ' ')
-  {
-    *p = '\0';
-    p--;
-  }
-
-  if (!strcmp (key, "coatlimit"))
+  else if (!strcmp (key, "memo"))
     {
-      luz->coverage_limit = strchr(line, '=') ? strtod (strchr (line, '=')+1, NULL) : 3.0;
-      if (luz->coverage_limit < 0.2)
-        luz->coverage_limit = 0.2;
+      luz->memo_size = atoi (rest);
+      if (luz->memo_size < LUZ_MEMO_SHARDS)
+        luz->memo_size = LUZ_MEMO_SHARDS;
       free (key);
       return;
     }
-  else if (!strcmp (key, "debugwidth"))
+  else if (!strcmp (key, "lutdim"))
     {
-      luz->debug_width= strchr(line, '=') ? strtod (strchr (line, '=')+1, NULL) : 25;
+      luz->lut_dim = atoi (rest);
+      if (luz->lut_dim < 2)
+        luz->lut_dim = 2;
+      else if (luz->lut_dim > LUT_DIM_MAX)
+        luz->lut_dim = LUT_DIM_MAX;
       free (key);
       return;
     }
@@ -854,7 +4857,7 @@ static void parse_config_line (Luz   *luz,
 
   s = luz_parse_spectrum (luz, strchr (line, '=') +1);
   {
-    luz_set_spectrum (luz, key, &s);
+    _luz_set_spectrum (luz, key, &s);
     for (i = 0; i < LUZ_MAX_COATS; i++)
     {
       Coat *coat = &luz->coat_def[i];
@@ -936,6 +4939,17 @@ luz_reset (Luz *luz)
       luz->coat_def[i].levels = 0;
     }
   luz->coverage_limit = LUZ_MAX_COATS;
+  luz->lut_dim = LUT_DIM;
+  luz->memo_size = LUZ_MEMO_DEFAULT;
+  luz->population = LUZ_LANES;
+  luz->seed_count = -1;
+  luz->refine = 0.5f;
+  luz->table_nodes = LUZ_OCTREE_NODES;
+  luz->subsets = -1;
+  luz->black = -1;
+  luz->black_amount = 1.0f;
+  luz->black_start = 0.25f;
+  luz->target_de = 0.5f;
 }
 
 static void
@@ -963,46 +4977,239 @@ luz_parse_int (Luz *luz, const char *p)
   parse_config_line (luz, acc);
 }
 
+static void
+luz_invalidate (Luz      *luz,
+                LuzDirty  dirt)
+{
+  int i;
+  if (dirt == LUZ_DIRTY_NONE)
+    return;
+  luz_memo_clear (luz->memo);
+  luz_invalidate_seeds (luz);
+  luz_invalidate_octree (luz);
+  luz_invalidate_gamut (luz);
+  luz_invalidate_hues (luz);
+  for (i = 0; i < luz->lut_dim * luz->lut_dim * luz->lut_dim; i++)
+  {
+    if (dirt == LUZ_DIRTY_FULL)
+      luz->lut[i].defined = LUZ_CELL_UNDEFINED;
+    else if (luz->lut[i].defined == LUZ_CELL_DEFINED)
+      luz->lut[i].defined = LUZ_CELL_STALE;
+    if (!luz->lab_lut)
+      continue;
+    if (dirt == LUZ_DIRTY_FULL)
+      luz->lab_lut[i].defined = LUZ_CELL_UNDEFINED;
+    else if (luz->lab_lut[i].defined == LUZ_CELL_DEFINED)
+      luz->lab_lut[i].defined = LUZ_CELL_STALE;
+  }
+}
+
+/* compares two parsed configurations, only looking at what the separation
+ * table depends on; the named spectrum database and debug settings are not
+ * considered.
+ */
+static LuzDirty
+luz_config_diff (const Luz *old,
+                 const Luz *new)
+{
+  LuzDirty dirt = LUZ_DIRTY_NONE;
+  int i;
+
+  if (old->coats != new->coats ||
+      old->lut_dim != new->lut_dim)
+    return LUZ_DIRTY_FULL;
+
+  for (i = 0; i < new->coats; i++)
+  {
+    const Coat *a = &old->coat_def[i];
+    const Coat *b = &new->coat_def[i];
+    if (memcmp (&a->on_white, &b->on_white, sizeof (Spectrum)) ||
+        memcmp (&a->on_black, &b->on_black, sizeof (Spectrum)))
+      return LUZ_DIRTY_FULL;
+    if (a->scale != b->scale ||
+        a->trc_gamma != b->trc_gamma ||
+        a->levels != b->levels) /* the seeds lattice, see luz_discrete */
+      dirt = LUZ_DIRTY_WARM;
+  }
+
+  if (memcmp (&old->illuminant, &new->illuminant, sizeof (Spectrum)) ||
+      memcmp (&old->substrate, &new->substrate, sizeof (Spectrum)) ||
+      memcmp (&old->STANDARD_OBSERVER_X, &new->STANDARD_OBSERVER_X, sizeof (Spectrum)) ||
+      memcmp (&old->STANDARD_OBSERVER_Y, &new->STANDARD_OBSERVER_Y, sizeof (Spectrum)) ||
+      memcmp (&old->STANDARD_OBSERVER_Z, &new->STANDARD_OBSERVER_Z, sizeof (Spectrum)))
+    dirt = LUZ_DIRTY_WARM;
+
+  if (old->coverage_limit != new->coverage_limit ||
+      old->objective != new->objective ||
+      old->solver != new->solver ||
+      old->population != new->population ||
+      old->generations != new->generations ||
+      old->seed_count != new->seed_count ||
+      old->subsets != new->subsets ||
+      old->gamut_map != new->gamut_map ||
+      old->black != new->black ||
+      old->black_generation != new->black_generation ||
+      old->black_amount != new->black_amount ||
+      old->black_start != new->black_start ||
+      old->target_de != new->target_de ||
+      old->STOCHASTIC_ITERATIONS != new->STOCHASTIC_ITERATIONS ||
+      old->STOCHASTIC_DIFFUSION0 != new->STOCHASTIC_DIFFUSION0 ||
+      old->STOCHASTIC_DIFFUSION1 != new->STOCHASTIC_DIFFUSION1)
+    dirt = LUZ_DIRTY_WARM;
+
+  return dirt;
+}
+
+/* the new configuration is parsed into a scratch instance, and diffed
+ * against the current one; the separation table survives and is only
+ * invalidated as much as the changes require.
+ */
 static void
 luz_parse_config (Luz       *luz,
                    const char *p)
 {
+  Luz *next;
+  LuzDirty dirt;
+  LuzTrace *traced; /* the trace the parse began in, if any */
+
   if (!p)
     return;
 
-  if (luz->src)
-    {
-      if (!strcmp (luz->src, p))
-        return;
-      free (luz->src);
-      luz->src = NULL;
-    }
+  if (luz->src && !strcmp (luz->src, p))
+    return;
+
+  traced = luz->trace;
+  LUZ_TRACE_BEGIN (luz, "parse config", -1);
+  next = calloc (sizeof (Luz), 1);
+  luz_reset (next);
 
-  luz_reset (luz);
+  luz_parse_int (next, config_internal);
+  luz_parse_int (next, p);
 
-  luz->src = strdup (p);
+  if (next->STOCHASTIC_DIFFUSION0 < 0.03)
+    next->STOCHASTIC_DIFFUSION0 = 0.03;
+  else if (next->STOCHASTIC_DIFFUSION0 > 100.0)
+    next->STOCHASTIC_DIFFUSION0 = 100.0;
+  if (next->STOCHASTIC_DIFFUSION1 < 0.03)
+    next->STOCHASTIC_DIFFUSION1 = 0.03;
+  else if (next->STOCHASTIC_DIFFUSION1 > 100.0)
+    next->STOCHASTIC_DIFFUSION1 = 100.0;
 
-  luz_parse_int (luz, config_internal);
-  luz_parse_int (luz, p);
+  luz_update_proof_illuminants (next);
+
+  dirt = luz->lut ? luz_config_diff (luz, next) : LUZ_DIRTY_FULL;
+
+  next->stats = luz->stats;
+  next->trace = luz->trace;
+  if (luz->memo && luz->memo_size == next->memo_size)
+    next->memo = luz->memo;
+  else
+  {
+    if (luz->memo)
+      LUZ_STAT_ADD (next, bytes_allocated,
+                    -luz_memo_memory_usage (luz->memo));
+    luz_memo_destroy (luz->memo);
+  }
+  next->seeds = luz->seeds; /* freed by luz_invalidate unless unchanged */
+  next->seeds_state = luz->seeds_state;
+  next->gamut = luz->gamut;
+  next->gamut_state = luz->gamut_state;
+  next->hues = luz->hues;
+  next->hues_state = luz->hues_state;
+  if (!memcmp (&luz->lit, &next->lit, sizeof (ProofIlluminant)) &&
+      !memcmp (luz->white_xyz, next->white_xyz, sizeof (luz->white_xyz)))
+  { /* fitted to the colours under the illuminant only */
+    next->upsample = luz->upsample;
+    next->upsample_state = luz->upsample_state;
+  }
+  else
+    luz_invalidate_upsample (luz);
+  if (luz->table == next->table && luz->refine == next->refine &&
+      luz->table_nodes == next->table_nodes)
+  {
+    next->octree = luz->octree;
+    next->octree_state = luz->octree_state;
+  }
+  else
+    luz_invalidate_octree (luz);
+  if (next->trace_path[0] && strcmp (next->trace_path, luz->trace_path) &&
+      luz->trace && luz->trace_path[0])
+  { /* trace= moved elsewhere, the old trace is written out */
+    if (traced == luz->trace)
+    {
+      luz_trace_add (traced, "parse config", 'E', -1);
+      traced = NULL;
+    }
+    luz_trace_destroy (luz->trace);
+    next->trace = NULL;
+  }
+  if (!next->trace && next->trace_path[0])
+    next->trace = luz_trace_new (next->trace_path);
+  if (luz->lut && luz->lut_dim == next->lut_dim)
+  {
+    next->lut = luz->lut;
+    next->lab_lut = luz->lab_lut;
+  }
+  else
+  {
+    if (luz->lut) /* and the Lab table of the same size */
+      LUZ_STAT_ADD (next, bytes_allocated,
+                    -sizeof (InkMix) * luz->lut_dim * luz->lut_dim *
+                     luz->lut_dim * (luz->lab_lut ? 2 : 1));
+    free (luz->lab_lut);
+    free (luz->lut);
+    next->lut = calloc (sizeof (InkMix),
+                        next->lut_dim * next->lut_dim * next->lut_dim);
+    LUZ_STAT_ADD (next, bytes_allocated,
+                  sizeof (InkMix) * next->lut_dim * next->lut_dim * next->lut_dim);
+  }
+  next->src = strdup (p);
+  if (luz->src)
+    free (luz->src);
+  *luz = *next;
+  free (next);
 
-  if (luz->STOCHASTIC_DIFFUSION0 < 0.03)
-    luz->STOCHASTIC_DIFFUSION0 = 0.03;
-  else if (luz->STOCHASTIC_DIFFUSION0 > 100.0)
-    luz->STOCHASTIC_DIFFUSION0 = 100.0;
-  if (luz->STOCHASTIC_DIFFUSION1 < 0.03)
-    luz->STOCHASTIC_DIFFUSION1 = 0.03;
-  else if (luz->STOCHASTIC_DIFFUSION1 > 100.0)
-    luz->STOCHASTIC_DIFFUSION1 = 100.0;
+  luz_invalidate (luz, dirt);
+  if (traced)
+    luz_trace_add (traced, "parse config", 'E', -1);
 }
 
 Luz *
 luz_new (const char *config)
 {
   Luz *luz = calloc (sizeof (Luz), 1);
+  luz->stats = aligned_alloc (sizeof (LuzStatsShard),
+                              sizeof (LuzStatsShard) * LUZ_STATS_SHARDS);
+  memset (luz->stats, 0, sizeof (LuzStatsShard) * LUZ_STATS_SHARDS);
+  LUZ_STAT_ADD (luz, bytes_allocated,
+                sizeof (Luz) + sizeof (LuzStatsShard) * LUZ_STATS_SHARDS);
+  if (getenv ("LUZ_TRACE"))
+  {
+    char path[512];
+    static int32_t count = 0;
+    snprintf (path, sizeof (path), "%sluz-trace-%i-%i.json",
+              getenv ("LUZ_TRACE"), (int) getpid (),
+              __atomic_add_fetch (&count, 1, __ATOMIC_RELAXED));
+    luz->trace = luz_trace_new (path);
+  }
   luz_parse_config (luz, config);
+  if (!luz->lut)
+  {
+    luz->lut_dim = LUT_DIM;
+    luz->lut = calloc (sizeof (InkMix), LUT_DIM * LUT_DIM * LUT_DIM);
+    LUZ_STAT_ADD (luz, bytes_allocated,
+                  sizeof (InkMix) * LUT_DIM * LUT_DIM * LUT_DIM);
+  }
   return luz;
 }
 
+void
+luz_set_config (Luz        *luz,
+                const char *config)
+{
+  luz_parse_config (luz, config);
+}
+
 void
 luz_destroy (Luz *luz)
 {
@@ -1011,9 +5218,73 @@ luz_destroy (Luz *luz)
       free (luz->src);
       luz->src = NULL;
     }
+  if (luz->trace)
+    luz_trace_destroy (luz->trace);
+  luz_memo_destroy (luz->memo);
+  luz_seeds_destroy (luz->seeds);
+  luz_octree_destroy (luz->octree);
+  free (luz->gamut);
+  free (luz->hues);
+  free (luz->upsample);
+  free (luz->lab_lut);
+  free (luz->lut);
+  free (luz->stats);
   free (luz);
 }
 
+static const float luz_residual_bins[LUZ_RESIDUAL_BINS - 1] =
+  {0.5f, 1.0f, 2.0f, 3.0f, 5.0f, 10.0f};
+
+void
+luz_get_stats (Luz      *luz,
+               LuzStats *stats)
+{
+  uint64_t *sum = (uint64_t *) stats;
+  int counters = sizeof (LuzStats) / sizeof (uint64_t);
+  int i, j;
+
+  memset (stats, 0, sizeof (LuzStats));
+  for (i = 0; i < LUZ_STATS_SHARDS; i++)
+  {
+    uint64_t *shard = (uint64_t *) &luz->stats[i].counters;
+    for (j = 0; j < counters; j++)
+      sum[j] += __atomic_load_n (&shard[j], __ATOMIC_RELAXED);
+  }
+  stats->lut_hits = stats->lut_lookups - stats->lut_misses;
+
+  /* the residuals are those of the current solutions, taken from the table
+     rather than counted */
+  for (i = 0; luz->lut && i < luz->lut_dim * luz->lut_dim * luz->lut_dim; i++)
+  {
+    float de = luz->lut[i].residual;
+    if (__atomic_load_n (&luz->lut[i].defined, __ATOMIC_ACQUIRE) !=
+        LUZ_CELL_DEFINED || de < 0.0f)
+      continue;
+    for (j = 0; j < LUZ_RESIDUAL_BINS - 1 && de >= luz_residual_bins[j]; j++);
+    stats->residual_cells[j]++;
+  }
+}
+
+void
+luz_reset_stats (Luz *luz)
+{
+  uint64_t bytes_allocated;
+  LuzStats stats;
+  int i;
+
+  luz_get_stats (luz, &stats);
+  bytes_allocated = stats.bytes_allocated;
+  for (i = 0; i < LUZ_STATS_SHARDS; i++)
+  {
+    uint64_t *shard = (uint64_t *) &luz->stats[i].counters;
+    int j;
+    for (j = 0; j < (int)(sizeof (LuzStats) / sizeof (uint64_t)); j++)
+      __atomic_store_n (&shard[j], 0, __ATOMIC_RELAXED);
+  }
+  /* allocations are still held, keep accounting for them */
+  LUZ_STAT_ADD (luz, bytes_allocated, bytes_allocated);
+}
+
 /* this API permits proofing with a lower amount of coats,
  * without writing a full new config for doing that, by
  * overriding the coat limit after loading the config
@@ -1026,7 +5297,11 @@ int luz_get_coat_count (Luz *luz)
 
 void luz_set_coat_count (Luz *luz, int count)
 {
+  if (count == luz->coats)
+    return;
   luz->coats = count;
+  luz_forget_config (luz);
+  luz_invalidate (luz, LUZ_DIRTY_FULL);
 }
 
 float luz_get_coverage_limit (Luz *luz)
@@ -1036,7 +5311,11 @@ float luz_get_coverage_limit (Luz *luz)
 
 void luz_set_coverage_limit (Luz *luz, float limit)
 {
+  if (limit == luz->coverage_limit)
+    return;
   luz->coverage_limit = limit;
+  luz_forget_config (luz);
+  luz_invalidate (luz, LUZ_DIRTY_WARM);
 }
 
 Spectrum luz_coats_to_spectrum  (Luz         *luz,
@@ -1044,3 +5323,450 @@ Spectrum luz_coats_to_spectrum  (Luz         *luz,
 {
   return coats_to_spectrum (luz, coat_levels);
 }
+
+/* device link tables, see luz.h for the formats */
+
+#define LUZ_TABLE_MAX_NODES (1 << 24)
+
+static int
+table_is_cube (const char *path)
+{
+  const char *ext = strrchr (path, '.');
+  return ext && !strcasecmp (ext, ".cube");
+}
+
+static void
+table_write_u32 (FILE     *file,
+                 uint32_t  val)
+{
+  uint8_t buf[4] = {val & 0xff, (val >> 8) & 0xff,
+                    (val >> 16) & 0xff, val >> 24};
+  fwrite (buf, 1, 4, file);
+}
+
+static int
+table_read_u32 (FILE     *file,
+                uint32_t *val)
+{
+  uint8_t buf[4];
+  if (fread (buf, 1, 4, file) != 4)
+    return -1;
+  *val = buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+  return 0;
+}
+
+static void
+table_write_float (FILE  *file,
+                   float  val)
+{
+  uint32_t bits;
+  memcpy (&bits, &val, 4);
+  table_write_u32 (file, bits);
+}
+
+static int
+table_read_float (FILE  *file,
+                  float *val)
+{
+  uint32_t bits;
+  if (table_read_u32 (file, &bits))
+    return -1;
+  memcpy (val, &bits, 4);
+  return 0;
+}
+
+/* evaluates one node of a table, index holds the position along each input
+ * axis
+ */
+static void
+table_node (Luz          *luz,
+            LuzTableKind  kind,
+            int           dim,
+            const int    *index,
+            float        *out)
+{
+  float in[LUZ_MAX_COATS];
+  int   in_channels = kind == LUZ_TABLE_SEPARATION ? 3 : luz->coats;
+  int   c;
+  for (c = 0; c < in_channels; c++)
+    in[c] = (float)index[c] / (dim - 1);
+  if (kind == LUZ_TABLE_SEPARATION)
+    luz_rgb_to_coats (luz, in, out);
+  else
+    luz_coats_to_rgb (luz, in, out);
+}
+
+int
+luz_export_table (Luz          *luz,
+                  const char   *path,
+                  LuzTableKind  kind,
+                  int           dim)
+{
+  int      in_channels  = kind == LUZ_TABLE_SEPARATION ? 3 : luz->coats;
+  int      out_channels = kind == LUZ_TABLE_SEPARATION ? luz->coats : 3;
+  int      cube = table_is_cube (path);
+  int      index[LUZ_MAX_COATS] = {0,};
+  uint64_t nodes = 1;
+  uint64_t n;
+  FILE    *file;
+  int      c;
+
+  if (dim < 2 || in_channels < 1 || out_channels < 1)
+    return -1;
+  if (kind == LUZ_TABLE_SEPARATION && dim > LUT_DIM_MAX)
+    return -1; /* larger than luz_import_table, or lutdim=, takes */
+  for (c = 0; c < in_channels; c++)
+    if ((nodes *= dim) > LUZ_TABLE_MAX_NODES)
+      return -1;
+  if (cube && (in_channels != 3 || out_channels > 3))
+    return -1;
+
+  file = fopen (path, "wb");
+  if (!file)
+    return -1;
+
+  if (cube)
+    fprintf (file, "TITLE \"luz %s\"\nLUT_3D_SIZE %i\n",
+             kind == LUZ_TABLE_SEPARATION ? "separation" : "proof", dim);
+  else
+  {
+    fwrite ("LUZT", 1, 4, file);
+    table_write_u32 (file, 1);
+    table_write_u32 (file, kind);
+    table_write_u32 (file, in_channels);
+    table_write_u32 (file, out_channels);
+    table_write_u32 (file, dim);
+  }
+
+  for (n = 0; n < nodes; n++)
+  {
+    float    out[LUZ_MAX_COATS] = {0.0f,};
+    uint64_t rest = n;
+
+    /* the last input varies fastest in luz tables, the first in .cube */
+    for (c = 0; c < in_channels; c++)
+    {
+      int axis = cube ? c : in_channels - 1 - c;
+      index[axis] = rest % dim;
+      rest /= dim;
+    }
+    table_node (luz, kind, dim, index, out);
+
+    if (cube)
+      fprintf (file, "%.6f %.6f %.6f\n", out[0], out[1], out[2]);
+    else
+      for (c = 0; c < out_channels; c++)
+        table_write_float (file, out[c]);
+  }
+
+  if (ferror (file))
+  {
+    fclose (file);
+    return -1;
+  }
+  return fclose (file) ? -1 : 0;
+}
+
+/* reads a .cube 3D LUT into the node order of the separation table */
+static int
+table_read_cube (FILE   *file,
+                 int    *dim,
+                 float **data)
+{
+  char line[1024];
+  int  size = 0;
+  int  n = 0;
+
+  *data = NULL;
+  while (fgets (line, sizeof (line), file))
+  {
+    float v[3];
+    if (line[0] == '#' || !strncmp (line, "TITLE", 5) ||
+        !strncmp (line, "DOMAIN_", 7))
+      continue;
+    if (!strncmp (line, "LUT_3D_SIZE", 11))
+    {
+      size = atoi (line + 11);
+      if (size < 2 || size > LUT_DIM_MAX || *data)
+        return -1;
+      *data = calloc (sizeof (float) * 3, size * size * size);
+    }
+    else if (sscanf (line, "%f %f %f", &v[0], &v[1], &v[2]) == 3)
+    {
+      int ri, gi, bi;
+      if (!*data || n >= size * size * size)
+        return -1;
+      ri = n % size;
+      gi = (n / size) % size;
+      bi = n / (size * size);
+      memcpy (*data + lut_index (size, ri, gi, bi) * 3, v, sizeof (v));
+      n++;
+    }
+  }
+  if (!*data || n != size * size * size)
+    return -1;
+  *dim = size;
+  return 0;
+}
+
+int
+luz_import_table (Luz        *luz,
+                  const char *path)
+{
+  FILE   *file = fopen (path, "rb");
+  float  *data = NULL;
+  int     channels;
+  int     dim = 0;
+  int     ret = -1;
+  InkMix *lut;
+  int     i, c;
+
+  if (!file)
+    return -1;
+  if (luz->table != LUZ_TABLE_UNIFORM)
+    goto done;
+
+  if (table_is_cube (path))
+  {
+    channels = 3;
+    if (luz->coats > 3 || table_read_cube (file, &dim, &data))
+      goto done;
+  }
+  else
+  {
+    char     magic[4];
+    uint32_t header[5];
+    if (fread (magic, 1, 4, file) != 4 || memcmp (magic, "LUZT", 4))
+      goto done;
+    for (i = 0; i < 5; i++)
+      if (table_read_u32 (file, &header[i]))
+        goto done;
+    if (header[0] != 1 || header[1] != LUZ_TABLE_SEPARATION ||
+        header[2] != 3 || header[3] != (uint32_t) luz->coats ||
+        header[4] < 2 || header[4] > LUT_DIM_MAX)
+      goto done;
+    dim = header[4];
+    channels = luz->coats;
+    data = malloc (sizeof (float) * channels * dim * dim * dim);
+    for (i = 0; i < channels * dim * dim * dim; i++)
+      if (table_read_float (file, &data[i]))
+        goto done;
+  }
+
+  lut = calloc (sizeof (InkMix), dim * dim * dim);
+  for (i = 0; i < dim * dim * dim; i++)
+  {
+    for (c = 0; c < luz->coats; c++)
+      lut[i].level[c] = data[i * channels + c];
+    lut[i].residual = -1.0f;
+    lut[i].defined = LUZ_CELL_DEFINED;
+  }
+  if (dim != luz->lut_dim)
+    LUZ_STAT_ADD (luz, bytes_allocated,
+                  sizeof (InkMix) * dim * dim * dim -
+                  sizeof (InkMix) * luz->lut_dim * luz->lut_dim * luz->lut_dim);
+  if (dim != luz->lut_dim)
+  { /* the Lab table has to be of the same size */
+    if (luz->lab_lut)
+      LUZ_STAT_ADD (luz, bytes_allocated,
+                    -sizeof (InkMix) * luz->lut_dim * luz->lut_dim * luz->lut_dim);
+    free (luz->lab_lut);
+    luz->lab_lut = NULL;
+  }
+  free (luz->lut);
+  luz->lut = lut;
+  luz->lut_dim = dim;
+  luz_memo_clear (luz->memo); /* solutions of the replaced table's model */
+  luz_invalidate_seeds (luz);
+  ret = 0;
+
+done:
+  free (data);
+  fclose (file);
+  return ret;
+}
+
+/* memory held by an instance, used for the cache budget - the tables,
+ * memo, seeds, octree, gamut, hues and upsampling, as counted in the
+ * bytes_allocated stat when created and freed
+ */
+static size_t
+luz_memory_usage (Luz *luz)
+{
+  uint64_t bytes = 0;
+  int i;
+  for (i = 0; i < LUZ_STATS_SHARDS; i++)
+    bytes += __atomic_load_n (&luz->stats[i].counters.bytes_allocated,
+                              __ATOMIC_RELAXED);
+  return bytes;
+}
+
+/* process wide cache of instances, shared between users with identical
+ * configurations; entries are refcounted and the least recently used
+ * unreferenced ones are evicted when the cache grows beyond its budget.
+ */
+
+#define LUZ_CACHE_DEFAULT_BUDGET  (64 * 1024 * 1024)
+
+typedef struct _LuzCacheEntry LuzCacheEntry;
+
+struct _LuzCacheEntry
+{
+  Luz           *luz;
+  int            refs;
+  uint64_t       last_use;
+  LuzCacheEntry *next;
+};
+
+static pthread_mutex_t luz_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LuzCacheEntry  *luz_cache = NULL;
+static uint64_t        luz_cache_tick = 0;
+static size_t          luz_cache_budget = 0;
+static int             luz_cache_budget_set = 0; /* by the environment or
+                                                    luz_cache_set_budget */
+
+static LuzCacheEntry *
+luz_cache_find (Luz *luz)
+{
+  LuzCacheEntry *entry;
+  for (entry = luz_cache; entry; entry = entry->next)
+    if (entry->luz == luz)
+      return entry;
+  return NULL;
+}
+
+static void
+luz_cache_trim (void)
+{
+  size_t used = 0;
+  LuzCacheEntry *entry;
+
+  if (!luz_cache_budget_set)
+  {
+    const char *env = getenv ("LUZ_CACHE_MB");
+    luz_cache_budget = env ? (size_t)atoi (env) * 1024 * 1024 :
+                             LUZ_CACHE_DEFAULT_BUDGET;
+    luz_cache_budget_set = 1;
+  }
+
+  for (entry = luz_cache; entry; entry = entry->next)
+    used += luz_memory_usage (entry->luz);
+
+  while (used > luz_cache_budget)
+  {
+    LuzCacheEntry **victim = NULL;
+    LuzCacheEntry **link;
+    LuzCacheEntry  *dead;
+
+    for (link = &luz_cache; *link; link = &(*link)->next)
+      if ((*link)->refs == 0 &&
+          (!victim || (*link)->last_use < (*victim)->last_use))
+        victim = link;
+    if (!victim)
+      return;
+
+    dead = *victim;
+    *victim = dead->next;
+    used -= luz_memory_usage (dead->luz);
+    luz_destroy (dead->luz);
+    free (dead);
+  }
+}
+
+/* returns a shared instance for config, to be released with
+ * luz_cache_release(); previous, if not NULL, is released. When no instance
+ * for config exists and the caller is the only user of previous, previous is
+ * reconfigured in place - keeping what it can of its separation table.
+ *
+ * shared instances must not be reconfigured or have their coat count or
+ * coverage limit changed.
+ */
+Luz *
+luz_cache_get (const char *config,
+               Luz        *previous)
+{
+  LuzCacheEntry *entry;
+  LuzCacheEntry *prev_entry = NULL;
+  Luz *ret = NULL;
+
+  if (!config)
+    config = "";
+
+  pthread_mutex_lock (&luz_cache_mutex);
+
+  if (previous)
+    prev_entry = luz_cache_find (previous);
+
+  for (entry = luz_cache; entry; entry = entry->next)
+    if (entry->luz->src && !strcmp (entry->luz->src, config))
+      break;
+
+  if (entry && entry == prev_entry)
+  {
+    entry->last_use = ++luz_cache_tick;
+    pthread_mutex_unlock (&luz_cache_mutex);
+    return previous;
+  }
+
+  if (entry)
+  {
+    entry->refs++;
+  }
+  else if (prev_entry && prev_entry->refs == 1)
+  {
+    luz_set_config (previous, config);
+    entry = prev_entry;
+    prev_entry = NULL;
+  }
+  else
+  {
+    entry = calloc (sizeof (LuzCacheEntry), 1);
+    entry->luz = luz_new (config);
+    entry->refs = 1;
+    entry->next = luz_cache;
+    luz_cache = entry;
+  }
+  entry->last_use = ++luz_cache_tick;
+  ret = entry->luz;
+
+  if (prev_entry)
+  {
+    prev_entry->refs--;
+    prev_entry->last_use = ++luz_cache_tick;
+  }
+
+  luz_cache_trim ();
+  pthread_mutex_unlock (&luz_cache_mutex);
+  return ret;
+}
+
+void
+luz_cache_release (Luz *luz)
+{
+  LuzCacheEntry *entry;
+  if (!luz)
+    return;
+  pthread_mutex_lock (&luz_cache_mutex);
+  entry = luz_cache_find (luz);
+  if (entry)
+  {
+    entry->refs--;
+    entry->last_use = ++luz_cache_tick;
+    /* unreferenced instances may be kept until exit, which destroys
+       nothing, write their traces out now */
+    if (entry->refs == 0 && luz->trace)
+      luz_trace_write (luz->trace);
+    luz_cache_trim ();
+  }
+  pthread_mutex_unlock (&luz_cache_mutex);
+}
+
+void
+luz_cache_set_budget (size_t bytes)
+{
+  pthread_mutex_lock (&luz_cache_mutex);
+  luz_cache_budget = bytes;
+  luz_cache_budget_set = 1;
+  luz_cache_trim ();
+  pthread_mutex_unlock (&luz_cache_mutex);
+}
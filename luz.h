@@ -15,16 +15,15 @@
  * Copyright 2014,2016,2018 Øyind Kolås <pippin@gimp.org>
  */
 
-// special case black coat in some cmyk's and use configurable undercolor
-// removal instead?
-
 #ifndef LUZSIM_H_
 #define LUZSIM_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct _Luz Luz;
 #define LUZ_MAX_COATS   16
+#define LUZ_MAX_ILLUMINANTS  8
 #define LUZ_SPECTRUM_START   390  /*                 380nm */
 #define LUZ_SPECTRUM_GAP     10
 #define LUZ_SPECTRUM_BANDS   31   /* 380 + 10 * 31 = 790nm */
@@ -33,6 +32,24 @@ typedef struct _Luz Luz;
 Luz    *luz_new                (const char  *config);
 void    luz_destroy            (Luz         *luz);
 
+/* reconfigure an existing instance; only the parts of the separation table
+ * affected by the differences to the previous configuration are recomputed.
+ * Not to be called concurrently with lookups or solves on the instance.
+ */
+void    luz_set_config         (Luz         *luz,
+                                const char  *config);
+
+/* refcounted instances shared process wide, keyed by configuration; the
+ * least recently used unreferenced instances are evicted when the cache
+ * exceeds its memory budget (LUZ_CACHE_MB in the environment, or set with
+ * luz_cache_set_budget), a budget of 0 keeps no unreferenced instances.
+ * Shared instances must be treated as read-only.
+ */
+Luz    *luz_cache_get          (const char  *config,
+                                Luz         *previous);
+void    luz_cache_release      (Luz         *luz);
+void    luz_cache_set_budget   (size_t       bytes);
+
 
 void    luz_coats_to_xyz       (Luz         *luz,
                                 const float *coat_levels,
@@ -40,17 +57,220 @@ void    luz_coats_to_xyz       (Luz         *luz,
 void    luz_coats_to_rgb       (Luz         *luz,
                                 const float *coat_levels,
                                 float       *rgb);
+/* with direct=1 in the configuration each distinct colour, to 1/4096, is
+ * solved directly rather than interpolated from the separation table, and
+ * remembered in the memo (see luz_spectrum_to_coats); exact for images of
+ * few colours at close to table speed. When every coat has discrete
+ * coatN.levels= their combinations are evaluated up front, and colours are
+ * given the best of them this way without any table.
+ *
+ * With subsets=1 solves search a few subsets of the coats, picked by the
+ * hue of the target and the hue each coat prints alone, with coats of
+ * little chroma in all of them, instead of all coats at once. The default,
+ * subsets=auto, does so when the walk would otherwise search six or more
+ * coats exhaustively, as with seeds=0; subsets=0 never does.
+ */
 void    luz_rgb_to_coats       (Luz         *luz,
                                 const float *rgb,
                                 float       *coat_levels);
+/* reduced precision variants for previews, level is a GEGL mipmap level;
+ * 0 is full precision, higher levels use a coarser subset of the separation
+ * table, also with direct=1, and fewer spectral bands.
+ */
+void    luz_rgb_to_coats_level (Luz         *luz,
+                                const float *rgb,
+                                float       *coat_levels,
+                                int          level);
+void    luz_coats_to_rgb_level (Luz         *luz,
+                                const float *coat_levels,
+                                float       *rgb,
+                                int          level);
+/* proofing under the illuminants listed in proof_illuminants=, like
+ * "proof_illuminants=D50 D65 A", defaulting to the configured illuminant.
+ * luz_coats_to_rgb_multi writes 3 components per illuminant, in the order
+ * listed. luz_coats_metamerism gives the largest CIEDE2000 difference
+ * between the colour under the first illuminant and under any of the
+ * others, each relative to its own white.
+ */
+int     luz_get_proof_illuminant_count (Luz *luz);
+void    luz_coats_to_rgb_multi (Luz         *luz,
+                                const float *coat_levels,
+                                float       *rgb);
+float   luz_coats_metamerism   (Luz         *luz,
+                                const float *coat_levels);
+/* separation of reflectance spectra, LUZ_SPECTRUM_BANDS values per sample
+ * starting at LUZ_SPECTRUM_START nm, coat levels are written packed with
+ * the coat count per sample. Spectra do not fit the RGB indexed separation
+ * table, each distinct spectrum is solved directly and remembered in a memo
+ * of memo= entries (default 65536), keyed on the spectrum quantised to
+ * 1/256.
+ */
+void    luz_spectrum_to_coats  (Luz         *luz,
+                                const float *reflectance,
+                                float       *coat_levels,
+                                int          count);
+/* resamples src_bands values, the first at src_start nm and the others
+ * src_gap nm apart, to LUZ_SPECTRUM_BANDS values for luz_spectrum_to_coats
+ */
+void    luz_spectrum_resample  (const float *src,
+                                int          src_bands,
+                                float        src_start,
+                                float        src_gap,
+                                float       *reflectance);
+/* smooth reflectances for linear RGB colours, clamped to 0.0 - 1.0, with
+ * the colour under the configured illuminant, for proofing RGB artwork
+ * spectrally - through luz_spectrum_to_coats, or under other illuminants.
+ * LUZ_SPECTRUM_BANDS values are written per colour, as luz_spectrum_to_coats
+ * takes them. The coefficients of the reflectances are fitted for a table
+ * on first use and interpolated, a pixel costs about as much as evaluating
+ * the reflectance. luz_rgb_to_spectrum does the same for one colour given
+ * with a gamma of 2.2.
+ */
+void    luz_rgb_to_reflectance (Luz         *luz,
+                                const float *rgb,
+                                float       *reflectance,
+                                int          count);
+/* separation of colours given as XYZ, Y being 1.0 for the white of the
+ * configured illuminant, or as CIE Lab relative to that white. These use a
+ * separate table with nodes evenly spaced in Lab, solved on demand like the
+ * RGB table; colours outside the RGB gamut are not clipped.
+ */
 void    luz_xyz_to_coats       (Luz         *luz,
                                 const float *xyz,
                                 float       *coat_levels);
+void    luz_lab_to_coats       (Luz         *luz,
+                                const float *lab,
+                                float       *coat_levels);
+/* whether a linear RGB colour can be reached with the coats, tested against
+ * segment maxima of the gamut in Lab, built from the forward model on first
+ * use. Each segment reaches as far as its furthest sample, so concave parts
+ * of the gamut are over-estimated, and colours there reported as in gamut.
+ * With gamutmap=clip in the configuration colours outside are moved to the
+ * boundary towards a neutral of middle lightness before being solved, with
+ * gamutmap=compress the outer fifth of the gamut is shared with the rest of
+ * the RGB cube; the default, gamutmap=none, leaves them to the solvers.
+ */
+int     luz_in_gamut           (Luz         *luz,
+                                const float *rgb);
+/* device links - sampled transforms for use outside luz.
+ *
+ * A separation table maps linear RGB to coat levels, as luz_rgb_to_coats,
+ * a proof table maps coat levels to linear RGB, as luz_coats_to_rgb. Both
+ * are sampled on a regular grid of dim nodes per input axis, spanning 0.0
+ * to 1.0; separation tables of 2 to 65 nodes, the range of lutdim=, and
+ * proof tables of at most 2^24 nodes in all.
+ *
+ * Paths ending in .cube are written as Adobe/Resolve 3D LUTs, which carry
+ * three outputs for three inputs; separation tables of fewer than three
+ * coats are padded with zeros, and proof tables need exactly three coats.
+ * Other paths use the luz binary table format, all values little endian:
+ *
+ *   char     magic[4]     "LUZT"
+ *   uint32_t version      1
+ *   uint32_t kind         0 separation, 1 proof
+ *   uint32_t in_channels  3 for separation, coat count for proof
+ *   uint32_t out_channels coat count for separation, 3 for proof
+ *   uint32_t dim          nodes per input axis
+ *   float    data[dim^in_channels * out_channels]
+ *
+ * with the first input channel varying slowest and the outputs of a node
+ * stored together.
+ *
+ * Importing a separation table replaces the instances solved table, and
+ * is kept until a configuration change invalidates it; colours remembered
+ * from direct solves and the seeds go with the old table. The grid size must
+ * be between 2 and 65, the channel count match the coat count, and the
+ * instance use the uniform table rather than table=adaptive. Like
+ * luz_set_config it is not to be called concurrently with lookups or
+ * solves on the instance. Both functions return 0 on success and -1 on
+ * failure.
+ */
+typedef enum {
+  LUZ_TABLE_SEPARATION = 0,
+  LUZ_TABLE_PROOF      = 1
+} LuzTableKind;
+
+int     luz_export_table       (Luz         *luz,
+                                const char  *path,
+                                LuzTableKind kind,
+                                int          dim);
+int     luz_import_table       (Luz         *luz,
+                                const char  *path);
+
+/* solves every cell of the RGB separation table now, in parallel, rather
+ * than as lookups need them. Solves stop once within target_de= of the
+ * colour (default 0.5 delta E). With the default objective=rgb solves stop
+ * on a proxy instead, a linear RGB distance of target_de / 50; the residuals
+ * refined and counted here are CIEDE2000 in either case. With build_seconds=
+ * in the configuration the time left of that budget goes to solving the cells
+ * furthest from their colour again, worst first, while that still brings
+ * them closer. Returns the number of cells left above target_de=, the
+ * distribution of the differences is in the residual_cells statistics.
+ * With table=adaptive this builds the tree, which refines itself by
+ * refine=, and returns 0.
+ */
+int     luz_build_table        (Luz         *luz);
+
+/* with black_coat=n coat n is not searched, it follows the grey component
+ * from black_start=, scaled by black_amount=; black_generation=ucr keeps it
+ * to near neutrals.
+ */
 float   luz_get_coverage_limit (Luz         *luz);
 void    luz_set_coverage_limit (Luz         *luz, float limit);
 void    luz_set_coat_count     (Luz         *luz, int count);
 int     luz_get_coat_count     (Luz         *luz);
 
+/* counters of work done by an instance, since creation or the last
+ * luz_reset_stats ()
+ */
+typedef struct _LuzStats LuzStats;
+
+#define LUZ_RESIDUAL_BINS 7
+
+struct _LuzStats {
+  uint64_t cells_solved;           /* separation table cells solved */
+  uint64_t lut_lookups;            /* table cells consulted */
+  uint64_t lut_hits;               /* of which were already solved */
+  uint64_t lut_misses;             /* solved, or waited for */
+  uint64_t wait_ns;                /* spent waiting for cells being solved by
+                                      other threads */
+  uint64_t griddy_evaluations;     /* forward model evaluations, exhaustive */
+  uint64_t stochastic_evaluations; /* forward model evaluations, stochastic */
+  uint64_t early_exits;            /* solves ending early as close enough */
+  uint64_t rejected_draws;         /* stochastic candidates above the
+                                      coverage limit */
+  uint64_t bytes_allocated;        /* by the instance */
+  uint64_t memo_lookups;           /* direct solves looked up in the memo */
+  uint64_t memo_hits;              /* of which were found */
+  uint64_t population_evaluations; /* forward model evaluations, population
+                                      solver */
+  uint64_t seed_lookups;           /* solves started from the nearest
+                                      forward samples */
+  uint64_t gamut_mapped;           /* solve targets moved into the gamut */
+  uint64_t refine_solves;          /* further solves of cells above target,
+                                      see luz_build_table */
+  uint64_t residual_cells[LUZ_RESIDUAL_BINS]; /* solved cells of the RGB
+                                      table by the CIEDE2000 difference of
+                                      their solution from the colour, below
+                                      0.5, 1, 2, 3, 5, 10 and the rest */
+};
+
+void    luz_get_stats          (Luz         *luz,
+                                LuzStats    *stats);
+void    luz_reset_stats        (Luz         *luz);
+
+/* tracing of parsing, cell solves and caller supplied spans - with
+ * trace=file.json in the configuration, or LUZ_TRACE=prefix in the
+ * environment which traces all instances to prefixluz-trace-pid-n.json.
+ * The trace is written as chrome trace json when the instance is
+ * destroyed, when a shared instance loses its last reference, and when
+ * trace= changes to another file; name must be a static string.
+ */
+void    luz_trace_begin        (Luz         *luz,
+                                const char  *name);
+void    luz_trace_end          (Luz         *luz,
+                                const char  *name);
+
 typedef struct _Spectrum Spectrum;
 
 Spectrum luz_parse_spectrum (Luz *luz, char *spectrum);
@@ -60,6 +280,12 @@ void            luz_set_spectrum (Luz *luz, const char *name, Spectrum *spectrum
 Spectrum luz_coats_to_spectrum  (Luz         *luz,
                                  const float *coat_levels);
 
+/* the smooth reflectance luz_rgb_to_reflectance gives, for a colour given
+ * with a gamma of 2.2. Before these were available it returned the mix of
+ * the red, green and blue spectra of the configuration instead, as the rgb
+ * keyword of configurations still does; colours under the illuminant now
+ * match the RGB given, spectra differ from those of earlier versions.
+ */
 Spectrum luz_rgb_to_spectrum (Luz *luz, float r, float g, float b);
 
 void luz_spectrum_to_rgb (Luz            *luz,